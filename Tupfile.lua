@@ -10,6 +10,8 @@ LDFLAGS = {}
 
 TOOLCHAIN = 'arm-linux-gnueabihf-' -- cross-compile
 --TOOLCHAIN = '' -- compile for the current architecture
+-- On a Pi 2 or newer, add '-mfpu=neon-vfpv4' to the flags below to use the NEON color kernels
+-- Add '-DLIGHTD_FIXED_POINT' to store and blend colors as 16-bit integers, e.g. for a Pi Zero
 
 -- C sources
 rpi_ws281x_package = define_package{
@@ -19,8 +21,10 @@ rpi_ws281x_package = define_package{
         'rpi_ws281x/pwm.c',
         'rpi_ws281x/pcm.c',
         'rpi_ws281x/dma.c',
-        'rpi_ws281x/rpihw.c'
-    }
+        'rpi_ws281x/rpihw.c',
+        'rpi_ws281x/mock.c'
+    },
+    libs={'pthread'}
 }
 
 lightd = define_package{
@@ -34,3 +38,23 @@ lightd = define_package{
 toolchain=GCCToolchain(TOOLCHAIN, 'build', {'-O3', '-g', '-D_XOPEN_SOURCE=500'}, {})
 build_executable('lightd', lightd, toolchain)
 
+-- Encoder benchmark, runs against the mock LED driver
+ws2811_bench = define_package{
+    packages={
+        rpi_ws281x_package
+    },
+    sources={'ws2811_bench.c'}
+}
+
+-- The driver sources are compiled again, so the objects go to their own directory
+bench_toolchain=GCCToolchain(TOOLCHAIN, 'build/bench', {'-O3', '-g', '-D_XOPEN_SOURCE=500'}, {})
+build_executable('ws2811_bench', ws2811_bench, bench_toolchain)
+
+-- DMA memory and control block chain test, runs against a fake mailbox
+ws2811_dma_test = define_package{
+    sources={'ws2811_dma_test.c', 'rpi_ws281x/dma.c'}
+}
+
+test_toolchain=GCCToolchain(TOOLCHAIN, 'build/test', {'-O3', '-g', '-D_XOPEN_SOURCE=500'}, {})
+build_executable('ws2811_dma_test', ws2811_dma_test, test_toolchain)
+
@@ -0,0 +1,329 @@
+#ifndef __ANIMATION_FILE_HPP
+#define __ANIMATION_FILE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <fibre/fibre.hpp>
+
+#include "rpi_ws281x/ws2811.h"
+#include "color_kernels.hpp"
+
+// Pre-baked animation file, all values little endian:
+//
+//   AnimationFileHeader
+//   num_frames frames
+//
+// Each frame is either num_leds colors or, with ANIMATION_DELTA, a uint32_t
+// change count followed by that many { uint32_t index; color } entries that
+// apply to the previous frame. The first delta frame applies to all LEDs off.
+// Colors are one of
+//   ANIMATION_RGBW8:  uint32_t 0xWWRRGGBB, the same as ws2811_led_t
+//   ANIMATION_RGBW16: rgbw16_t, 4 x uint16_t in 8.8 fixed point (0xff00 is full)
+struct AnimationFileHeader {
+    char magic[4];              // "LDAN"
+    uint8_t version;            // 1
+    uint8_t format;             // ANIMATION_RGBW8 or ANIMATION_RGBW16
+    uint8_t flags;              // ANIMATION_DELTA
+    uint8_t reserved;
+    uint32_t num_leds;
+    uint32_t num_frames;
+    uint32_t frame_duration_us;
+};
+
+static_assert(sizeof(AnimationFileHeader) == 20, "the header layout is part of the file format");
+
+enum : uint8_t {
+    ANIMATION_RGBW8 = 0,
+    ANIMATION_RGBW16 = 1
+};
+
+enum : uint8_t {
+    ANIMATION_DELTA = 0x01
+};
+
+// A validated animation file, mapped into memory. The pages are populated
+// when it's opened, so playing it doesn't fault on the render thread.
+// It's reference counted, so all LED strips can play the same mapping. The
+// last release() unmaps it.
+class AnimationFile {
+public:
+    // Returns nullptr if the file can't be read or is malformed. The caller
+    // holds the first reference.
+    static AnimationFile* open(const char* path) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            return nullptr;
+        }
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (!fstat(fd, &st) && st.st_size >= static_cast<off_t>(sizeof(AnimationFileHeader)))
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        ::close(fd); // the mapping stays valid
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "can't map %s\n", path);
+            return nullptr;
+        }
+
+        AnimationFile* file = new AnimationFile(static_cast<const uint8_t*>(data), st.st_size);
+        if (!file->validate()) {
+            fprintf(stderr, "%s is not a valid animation file\n", path);
+            delete file;
+            return nullptr;
+        }
+        return file;
+    }
+
+    void acquire() {
+        references_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    const AnimationFileHeader& header() const { return *reinterpret_cast<const AnimationFileHeader*>(data_); }
+    const uint8_t* frames() const { return data_ + sizeof(AnimationFileHeader); }
+    size_t color_size() const { return header().format == ANIMATION_RGBW16 ? sizeof(rgbw16_t) : sizeof(ws2811_led_t); }
+    bool is_delta() const { return header().flags & ANIMATION_DELTA; }
+
+private:
+    AnimationFile(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    ~AnimationFile() {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+
+    // Checks everything the player relies on, so it doesn't have to check again
+    bool validate() {
+        const AnimationFileHeader& h = header();
+        if (memcmp(h.magic, "LDAN", 4) || h.version != 1 || h.format > ANIMATION_RGBW16
+            || (h.flags & ~ANIMATION_DELTA) || !h.num_leds || !h.num_frames || !h.frame_duration_us)
+            return false;
+
+        size_t available = size_ - sizeof(AnimationFileHeader);
+        if (!is_delta())
+            return h.num_frames <= available / (static_cast<uint64_t>(h.num_leds) * color_size());
+
+        size_t offset = 0;
+        size_t entry_size = sizeof(uint32_t) + color_size();
+        for (uint32_t frame = 0; frame < h.num_frames; ++frame) {
+            uint32_t count;
+            if (available - offset < sizeof(count))
+                return false;
+            memcpy(&count, frames() + offset, sizeof(count));
+            offset += sizeof(count);
+            if ((available - offset) / entry_size < count)
+                return false;
+            for (uint32_t i = 0; i < count; ++i, offset += entry_size) {
+                uint32_t index;
+                memcpy(&index, frames() + offset, sizeof(index));
+                if (index >= h.num_leds)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    const uint8_t* data_;
+    size_t size_;
+    std::atomic<unsigned> references_{1};
+};
+
+// Plays an AnimationFile into a ws2811_led_t buffer. Plain frames are copied
+// (8-bit) or packed (16-bit), delta frames only touch the LEDs that change.
+class AnimationFilePlayer {
+public:
+    void start(const AnimationFile* file, bool loop) {
+        file_ = file;
+        loop_ = loop;
+        next_frame_ = 0;
+        offset_ = 0;
+        last_frame_ = SIZE_MAX;
+    }
+
+    void stop() {
+        file_ = nullptr;
+    }
+
+    const AnimationFile* get_file() { return file_; }
+
+    // Writes the frame that is due after elapsed_ns into leds and returns
+    // the time since the start when the next one is due, UINT64_MAX after
+    // the last one. leds must hold what the previous call wrote. new_frame
+    // is set to whether leds changed, i.e. it's a different frame than last time.
+    uint64_t draw(uint64_t elapsed_ns, ws2811_led_t* leds, size_t count, bool* new_frame) {
+        const AnimationFileHeader& header = file_->header();
+        uint64_t frame_duration_ns = header.frame_duration_us * 1000ull;
+        uint64_t frame = elapsed_ns / frame_duration_ns;
+        uint64_t end = UINT64_MAX;
+        if (loop_) {
+            end = (frame + 1) * frame_duration_ns;
+            frame %= header.num_frames;
+        } else if (frame >= header.num_frames - 1) {
+            frame = header.num_frames - 1;
+        } else {
+            end = (frame + 1) * frame_duration_ns;
+        }
+
+        count = std::min(count, static_cast<size_t>(header.num_leds));
+        *new_frame = frame != last_frame_;
+        if (!*new_frame)
+            return end;
+        last_frame_ = frame;
+
+        if (!file_->is_delta()) {
+            const uint8_t* data = file_->frames() + frame * header.num_leds * file_->color_size();
+            if (header.format == ANIMATION_RGBW16)
+                rgbw_pack_array(reinterpret_cast<const rgbw16_t*>(data), leds, count);
+            else
+                memcpy(leds, data, count * sizeof(ws2811_led_t));
+            return end;
+        }
+
+        if (frame < next_frame_ || !next_frame_) {
+            // started or looped, start over from all LEDs off
+            memset(leds, 0, count * sizeof(ws2811_led_t));
+            next_frame_ = 0;
+            offset_ = 0;
+        }
+        // apply every frame up to this one, also the ones that were skipped
+        size_t entry_size = sizeof(uint32_t) + file_->color_size();
+        for (; next_frame_ <= frame; ++next_frame_) {
+            const uint8_t* data = file_->frames() + offset_;
+            uint32_t changes = *reinterpret_cast<const uint32_t*>(data);
+            data += sizeof(uint32_t);
+            for (uint32_t i = 0; i < changes; ++i, data += entry_size) {
+                uint32_t index = *reinterpret_cast<const uint32_t*>(data);
+                if (index >= count)
+                    continue;
+                if (header.format == ANIMATION_RGBW16)
+                    rgbw_pack_array(reinterpret_cast<const rgbw16_t*>(data + sizeof(uint32_t)), &leds[index], 1);
+                else
+                    leds[index] = *reinterpret_cast<const ws2811_led_t*>(data + sizeof(uint32_t));
+            }
+            offset_ += sizeof(uint32_t) + changes * entry_size;
+        }
+        return end;
+    }
+
+private:
+    const AnimationFile* file_ = nullptr;
+    bool loop_ = false;
+    uint64_t next_frame_ = 0; // delta frames: the next one to apply
+    size_t offset_ = 0;       // delta frames: where the next one starts
+    uint64_t last_frame_ = SIZE_MAX;
+};
+
+// Directory of animation files, named by slot number: <dir>/<slot>.anim.
+// Files can be copied there directly or uploaded through Fibre. Fibre
+// functions only take scalars, so an upload goes in 32-byte chunks and is
+// meant for small files.
+class AnimationStore {
+public:
+    void set_directory(const char* directory) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        directory_ = directory;
+    }
+
+    AnimationFile* open(uint32_t slot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return AnimationFile::open(get_path(slot).c_str());
+    }
+
+    // Starts uploading a file of the given size into a slot. Any unfinished
+    // upload is discarded.
+    bool upload_begin(uint32_t slot, uint32_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        discard_upload();
+        upload_fd_ = ::open(get_upload_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (upload_fd_ < 0) {
+            fprintf(stderr, "can't create %s\n", get_upload_path().c_str());
+            return false;
+        }
+        upload_slot_ = slot;
+        upload_size_ = size;
+        upload_offset_ = 0;
+        return true;
+    }
+
+    // Appends the next 32 bytes, the last chunk is cut off at the file size
+    bool upload_data(uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3,
+                     uint32_t d4, uint32_t d5, uint32_t d6, uint32_t d7) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint32_t chunk[8] = { d0, d1, d2, d3, d4, d5, d6, d7 };
+        size_t length = std::min(sizeof(chunk), static_cast<size_t>(upload_size_ - upload_offset_));
+        if (upload_fd_ < 0 || pwrite(upload_fd_, chunk, length, upload_offset_) != static_cast<ssize_t>(length)) {
+            discard_upload();
+            return false;
+        }
+        upload_offset_ += length;
+        return true;
+    }
+
+    // Moves the uploaded file into its slot if it's complete and valid.
+    // Files that are playing keep their old contents until they're played again.
+    bool upload_finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (upload_fd_ < 0 || upload_offset_ != upload_size_) {
+            discard_upload();
+            return false;
+        }
+        bool ok = !fsync(upload_fd_);
+        ::close(upload_fd_);
+        upload_fd_ = -1;
+
+        AnimationFile* file = ok ? AnimationFile::open(get_upload_path().c_str()) : nullptr;
+        if (file)
+            file->release(); // only opened to validate it
+        if (!file || rename(get_upload_path().c_str(), get_path(upload_slot_).c_str())) {
+            unlink(get_upload_path().c_str());
+            return false;
+        }
+        printf("uploaded animation %u\n", upload_slot_);
+        return true;
+    }
+
+    FIBRE_EXPORTS(AnimationStore,
+        make_fibre_function("upload_begin", *obj, &AnimationStore::upload_begin, "slot", "size"),
+        make_fibre_function("upload_data", *obj, &AnimationStore::upload_data, "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7"),
+        make_fibre_function("upload_finish", *obj, &AnimationStore::upload_finish)
+    );
+
+private:
+    std::string get_path(uint32_t slot) {
+        return directory_ + "/" + std::to_string(slot) + ".anim";
+    }
+
+    std::string get_upload_path() {
+        return directory_ + "/upload.tmp"; // renamed when complete, so players never see a partial file
+    }
+
+    void discard_upload() {
+        if (upload_fd_ >= 0) {
+            ::close(upload_fd_);
+            unlink(get_upload_path().c_str());
+        }
+        upload_fd_ = -1;
+    }
+
+    std::mutex mutex_; // between the Fibre threads
+    std::string directory_ = "/var/lib/lightd/animations";
+    int upload_fd_ = -1;
+    uint32_t upload_slot_ = 0;
+    uint32_t upload_size_ = 0;
+    uint32_t upload_offset_ = 0;
+};
+
+#endif // __ANIMATION_FILE_HPP
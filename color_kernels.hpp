@@ -0,0 +1,413 @@
+#ifndef __COLOR_KERNELS_HPP
+#define __COLOR_KERNELS_HPP
+
+// Color math on whole LED arrays. This runs for every LED in every frame, so
+// besides the plain C++ version there are NEON (ARM) and SSE/AVX (x86)
+// versions, picked by the compiler flags. All versions compute the same
+// results. NEON is only available with -mfpu=neon on 32-bit ARM.
+//
+// Colors are stored as 4 floats (rgbw_t) or, with -DLIGHTD_FIXED_POINT, as
+// 4 16-bit integers (rgbw16_t). The fixed-point type takes half the memory and
+// avoids the FPU, which is slow on a Pi Zero. Its output is within 1 of the
+// float path on each channel. color_t is the type selected at compile time.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define COLOR_KERNELS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#define COLOR_KERNELS_SSE
+#endif
+
+#include "rpi_ws281x/ws2811.h"
+
+// TODO: change to L*u*v* color space
+typedef struct {
+    float w, r, g, b;
+} rgbw_t;
+
+// The vector kernels load one LED as one 128-bit vector
+static_assert(sizeof(rgbw_t) == 4 * sizeof(float), "rgbw_t must be 4 packed floats");
+
+// alpha: 0...1 corresponds to color1...color2
+static inline rgbw_t rgbw_blend(rgbw_t color1, rgbw_t color2, float alpha) {
+    return {
+        .w = color1.w * (1 - alpha) + color2.w * alpha,
+        .r = color1.r * (1 - alpha) + color2.r * alpha,
+        .g = color1.g * (1 - alpha) + color2.g * alpha,
+        .b = color1.b * (1 - alpha) + color2.b * alpha,
+    };
+}
+
+// clamps to [0...1] and scales to [0...255]
+static inline uint8_t rgbw_to_uint8(float val) {
+    return (val <= 0) ? 0 : (val >= 1) ? 255 : static_cast<uint8_t>(val * 255.f);
+}
+
+// Blends count colors: output[i] = rgbw_blend(color1[i], color2[i], alpha)
+// output may be the same array as color1 or color2.
+static inline void rgbw_blend_array(const rgbw_t* color1, const rgbw_t* color2, float alpha,
+                                    rgbw_t* output, size_t count) {
+    size_t i = 0;
+#if defined(COLOR_KERNELS_NEON)
+    float beta = 1 - alpha;
+    for (; i < count; ++i) {
+        // separate multiply and add, like the scalar code
+        float32x4_t c1 = vmulq_n_f32(vld1q_f32(&color1[i].w), beta);
+        float32x4_t c2 = vmulq_n_f32(vld1q_f32(&color2[i].w), alpha);
+        vst1q_f32(&output[i].w, vaddq_f32(c1, c2));
+    }
+#elif defined(COLOR_KERNELS_SSE)
+#ifdef __AVX__
+    __m256 alpha8 = _mm256_set1_ps(alpha);
+    __m256 beta8 = _mm256_set1_ps(1 - alpha);
+    for (; i + 2 <= count; i += 2) {
+        __m256 c1 = _mm256_mul_ps(_mm256_loadu_ps(&color1[i].w), beta8);
+        __m256 c2 = _mm256_mul_ps(_mm256_loadu_ps(&color2[i].w), alpha8);
+        _mm256_storeu_ps(&output[i].w, _mm256_add_ps(c1, c2));
+    }
+#endif
+    __m128 alpha4 = _mm_set1_ps(alpha);
+    __m128 beta4 = _mm_set1_ps(1 - alpha);
+    for (; i < count; ++i) {
+        __m128 c1 = _mm_mul_ps(_mm_loadu_ps(&color1[i].w), beta4);
+        __m128 c2 = _mm_mul_ps(_mm_loadu_ps(&color2[i].w), alpha4);
+        _mm_storeu_ps(&output[i].w, _mm_add_ps(c1, c2));
+    }
+#endif
+    for (; i < count; ++i)
+        output[i] = rgbw_blend(color1[i], color2[i], alpha);
+}
+
+// Clamps, scales and packs count colors into the driver's 0xWWRRGGBB format
+static inline void rgbw_pack_array(const rgbw_t* colors, ws2811_led_t* output, size_t count) {
+    size_t i = 0;
+#if defined(COLOR_KERNELS_NEON)
+    float32x4_t zero = vdupq_n_f32(0.f);
+    float32x4_t one = vdupq_n_f32(1.f);
+    for (; i + 4 <= count; i += 4) {
+        // de-interleave 4 LEDs into one vector per channel
+        float32x4x4_t c = vld4q_f32(&colors[i].w);
+        uint32x4_t channel[4];
+        for (int j = 0; j < 4; ++j) {
+            float32x4_t val = vminq_f32(vmaxq_f32(c.val[j], zero), one);
+            channel[j] = vcvtq_u32_f32(vmulq_n_f32(val, 255.f)); // truncates
+        }
+        uint32x4_t wr = vorrq_u32(vshlq_n_u32(channel[0], 24), vshlq_n_u32(channel[1], 16));
+        uint32x4_t gb = vorrq_u32(vshlq_n_u32(channel[2], 8), channel[3]);
+        vst1q_u32(&output[i], vorrq_u32(wr, gb));
+    }
+#elif defined(COLOR_KERNELS_SSE)
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.f);
+    __m128 scale = _mm_set1_ps(255.f);
+    for (; i + 4 <= count; i += 4) {
+        __m128i channels[4];
+        for (int j = 0; j < 4; ++j) {
+            __m128 val = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(&colors[i + j].w), zero), one);
+            // w, r, g, b => b, g, r, w, so the bytes end up in little endian 0xWWRRGGBB order
+            val = _mm_shuffle_ps(val, val, _MM_SHUFFLE(0, 1, 2, 3));
+            channels[j] = _mm_cvttps_epi32(_mm_mul_ps(val, scale)); // truncates
+        }
+        __m128i lo = _mm_packs_epi32(channels[0], channels[1]);
+        __m128i hi = _mm_packs_epi32(channels[2], channels[3]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[i]), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < count; ++i) {
+        const rgbw_t *color = &colors[i];
+        output[i] = ((uint32_t)(rgbw_to_uint8(color->w) << 24) + (uint32_t)(rgbw_to_uint8(color->r) << 16) +
+                     (uint32_t)(rgbw_to_uint8(color->g) << 8) + (uint32_t)(rgbw_to_uint8(color->b) << 0));
+    }
+}
+
+// 8.8 fixed-point color, the upper byte is the output value
+typedef struct {
+    uint16_t w, r, g, b;
+} rgbw16_t;
+
+constexpr uint16_t RGBW16_ONE = 0xff00; // 1.0, anything above is clamped
+
+static_assert(sizeof(rgbw16_t) == 4 * sizeof(uint16_t), "rgbw16_t must be 4 packed uint16_t");
+
+static inline uint16_t rgbw16_from_float(float val) {
+    return (val <= 0) ? 0 : (val >= 1) ? RGBW16_ONE : static_cast<uint16_t>(val * RGBW16_ONE);
+}
+
+// alpha as used by the 16-bit blend: 0...1 maps to 0...0x8000
+static inline uint32_t rgbw16_alpha(float alpha) {
+    return (alpha <= 0) ? 0 : (alpha >= 1) ? 0x8000 : static_cast<uint32_t>(alpha * 0x8000 + 0.5f);
+}
+
+// alpha: 0...0x8000 corresponds to color1...color2
+static inline rgbw16_t rgbw16_blend(rgbw16_t color1, rgbw16_t color2, uint32_t alpha) {
+    uint32_t beta = 0x8000 - alpha; // the sums stay below 2^31
+    return {
+        .w = static_cast<uint16_t>((color1.w * beta + color2.w * alpha) >> 15),
+        .r = static_cast<uint16_t>((color1.r * beta + color2.r * alpha) >> 15),
+        .g = static_cast<uint16_t>((color1.g * beta + color2.g * alpha) >> 15),
+        .b = static_cast<uint16_t>((color1.b * beta + color2.b * alpha) >> 15),
+    };
+}
+
+static inline void rgbw_blend_array(const rgbw16_t* color1, const rgbw16_t* color2, float alpha,
+                                    rgbw16_t* output, size_t count) {
+    uint32_t a = rgbw16_alpha(alpha);
+    size_t i = 0;
+#if defined(COLOR_KERNELS_NEON)
+    uint16x4_t alpha4 = vdup_n_u16(static_cast<uint16_t>(a));
+    uint16x4_t beta4 = vdup_n_u16(static_cast<uint16_t>(0x8000 - a));
+    for (; i + 2 <= count; i += 2) {
+        uint16x8_t c1 = vld1q_u16(&color1[i].w);
+        uint16x8_t c2 = vld1q_u16(&color2[i].w);
+        uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(c1), beta4), vget_low_u16(c2), alpha4);
+        uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(c1), beta4), vget_high_u16(c2), alpha4);
+        vst1q_u16(&output[i].w, vcombine_u16(vshrn_n_u32(lo, 15), vshrn_n_u32(hi, 15)));
+    }
+#elif defined(COLOR_KERNELS_SSE)
+    __m128i alpha8 = _mm_set1_epi16(static_cast<short>(a));
+    __m128i beta8 = _mm_set1_epi16(static_cast<short>(0x8000 - a));
+    __m128i bias = _mm_set1_epi32(0x8000);
+    for (; i + 2 <= count; i += 2) {
+        __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&color1[i]));
+        __m128i c2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&color2[i]));
+        // 32-bit products from the low and high halves of 16x16 bit multiplications
+        __m128i p1lo = _mm_mullo_epi16(c1, beta8), p1hi = _mm_mulhi_epu16(c1, beta8);
+        __m128i p2lo = _mm_mullo_epi16(c2, alpha8), p2hi = _mm_mulhi_epu16(c2, alpha8);
+        __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(p1lo, p1hi), _mm_unpacklo_epi16(p2lo, p2hi));
+        __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(p1lo, p1hi), _mm_unpackhi_epi16(p2lo, p2hi));
+        // SSE2 can only pack with signed saturation, so move the range to signed and back
+        lo = _mm_sub_epi32(_mm_srli_epi32(lo, 15), bias);
+        hi = _mm_sub_epi32(_mm_srli_epi32(hi, 15), bias);
+        __m128i result = _mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16(static_cast<short>(0x8000)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[i]), result);
+    }
+#endif
+    for (; i < count; ++i)
+        output[i] = rgbw16_blend(color1[i], color2[i], a);
+}
+
+static inline void rgbw_pack_array(const rgbw16_t* colors, ws2811_led_t* output, size_t count) {
+    size_t i = 0;
+#if defined(COLOR_KERNELS_NEON)
+    for (; i + 2 <= count; i += 2) {
+        // w, r, g, b => b, g, r, w, so the bytes end up in little endian 0xWWRRGGBB order
+        uint16x8_t c = vrev64q_u16(vld1q_u16(&colors[i].w));
+        vst1_u8(reinterpret_cast<uint8_t*>(&output[i]), vshrn_n_u16(c, 8));
+    }
+#elif defined(COLOR_KERNELS_SSE)
+    for (; i + 4 <= count; i += 4) {
+        __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&colors[i]));
+        __m128i c2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&colors[i + 2]));
+        // w, r, g, b => b, g, r, w, so the bytes end up in little endian 0xWWRRGGBB order
+        c1 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c1, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+        c2 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c2, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+        __m128i bytes = _mm_packus_epi16(_mm_srli_epi16(c1, 8), _mm_srli_epi16(c2, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&output[i]), bytes);
+    }
+#endif
+    for (; i < count; ++i) {
+        const rgbw16_t *color = &colors[i];
+        output[i] = ((uint32_t)(color->w >> 8) << 24) + ((uint32_t)(color->r >> 8) << 16) +
+                    ((uint32_t)(color->g >> 8) << 8) + ((uint32_t)(color->b >> 8) << 0);
+    }
+}
+
+// Inverse of rgbw_pack_array, to continue from colors that were packed
+// elsewhere. Packing the result again gives the same values.
+static inline void rgbw_unpack_array(const ws2811_led_t* input, rgbw_t* colors, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        // the middle of each step, so the truncation when packing is safe
+        colors[i].w = (((input[i] >> 24) & 0xff) + 0.5f) / 255.f;
+        colors[i].r = (((input[i] >> 16) & 0xff) + 0.5f) / 255.f;
+        colors[i].g = (((input[i] >> 8) & 0xff) + 0.5f) / 255.f;
+        colors[i].b = (((input[i] >> 0) & 0xff) + 0.5f) / 255.f;
+    }
+}
+
+static inline void rgbw_unpack_array(const ws2811_led_t* input, rgbw16_t* colors, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        colors[i].w = ((input[i] >> 24) & 0xff) << 8;
+        colors[i].r = ((input[i] >> 16) & 0xff) << 8;
+        colors[i].g = ((input[i] >> 8) & 0xff) << 8;
+        colors[i].b = ((input[i] >> 0) & 0xff) << 8;
+    }
+}
+
+// Interleaves one array per channel (e.g. from the effect kernels) into
+// colors. Values are not clamped.
+static inline void rgbw_interleave_array(const float* w, const float* r, const float* g, const float* b,
+                                         rgbw_t* colors, size_t count) {
+    size_t i = 0;
+#if defined(COLOR_KERNELS_NEON)
+    for (; i + 4 <= count; i += 4) {
+        float32x4x4_t c = { { vld1q_f32(&w[i]), vld1q_f32(&r[i]), vld1q_f32(&g[i]), vld1q_f32(&b[i]) } };
+        vst4q_f32(&colors[i].w, c);
+    }
+#elif defined(COLOR_KERNELS_SSE)
+    for (; i + 4 <= count; i += 4) {
+        __m128 c0 = _mm_loadu_ps(&w[i]), c1 = _mm_loadu_ps(&r[i]), c2 = _mm_loadu_ps(&g[i]), c3 = _mm_loadu_ps(&b[i]);
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+        _mm_storeu_ps(&colors[i].w, c0);
+        _mm_storeu_ps(&colors[i + 1].w, c1);
+        _mm_storeu_ps(&colors[i + 2].w, c2);
+        _mm_storeu_ps(&colors[i + 3].w, c3);
+    }
+#endif
+    for (; i < count; ++i)
+        colors[i] = { .w = w[i], .r = r[i], .g = g[i], .b = b[i] };
+}
+
+// Same for the fixed-point colors, clamped to [0...1]
+static inline void rgbw_interleave_array(const float* w, const float* r, const float* g, const float* b,
+                                         rgbw16_t* colors, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        colors[i] = {
+            .w = rgbw16_from_float(w[i]),
+            .r = rgbw16_from_float(r[i]),
+            .g = rgbw16_from_float(g[i]),
+            .b = rgbw16_from_float(b[i]),
+        };
+    }
+}
+
+// The values are part of the Fibre interface
+enum BlendMode : uint32_t {
+    BLEND_NORMAL = 0,   // above
+    BLEND_ADD = 1,      // below + above, saturating
+    BLEND_MULTIPLY = 2, // below * above
+    BLEND_MAX = 3       // the brighter one per channel
+};
+
+// Combines each channel of two layers according to mode, without alpha.
+// Mixing the result with below by alpha (rgbw_blend_array) gives the
+// composite. The loops are simple enough for the compiler to vectorize.
+static inline void rgbw_combine_array(BlendMode mode, const rgbw_t* below, const rgbw_t* above,
+                                      rgbw_t* output, size_t count) {
+    const float* b = &below[0].w;
+    const float* a = &above[0].w;
+    float* out = &output[0].w;
+    switch (mode) {
+        case BLEND_ADD:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = std::min(b[i] + a[i], 1.f);
+            break;
+        case BLEND_MULTIPLY:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = b[i] * a[i];
+            break;
+        case BLEND_MAX:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = std::max(b[i], a[i]);
+            break;
+        default:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = a[i];
+            break;
+    }
+}
+
+static inline void rgbw_combine_array(BlendMode mode, const rgbw16_t* below, const rgbw16_t* above,
+                                      rgbw16_t* output, size_t count) {
+    const uint16_t* b = &below[0].w;
+    const uint16_t* a = &above[0].w;
+    uint16_t* out = &output[0].w;
+    switch (mode) {
+        case BLEND_ADD:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = std::min<uint32_t>(b[i] + a[i], RGBW16_ONE);
+            break;
+        case BLEND_MULTIPLY:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = (static_cast<uint32_t>(b[i]) * a[i]) / RGBW16_ONE;
+            break;
+        case BLEND_MAX:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = std::max(b[i], a[i]);
+            break;
+        default:
+            for (size_t i = 0; i < count * 4; ++i)
+                out[i] = a[i];
+            break;
+    }
+}
+
+// Channels in units of the packed output, i.e. 0...255
+static inline void rgbw_output_units(const rgbw_t& color, float* out) {
+    out[0] = color.w * 255.f; out[1] = color.r * 255.f; out[2] = color.g * 255.f; out[3] = color.b * 255.f;
+}
+
+static inline void rgbw_output_units(const rgbw16_t& color, float* out) {
+    out[0] = color.w / 256.f; out[1] = color.r / 256.f; out[2] = color.g / 256.f; out[3] = color.b / 256.f;
+}
+
+// Returns the time in seconds until the packed output of a blend from color1
+// to color2 changes, when alpha grows by alpha_rate per second. Returns
+// INFINITY if it never changes. Rounding errors make the result a bit early
+// rather than late.
+template<typename TColor>
+static inline float rgbw_time_to_next_step(const TColor* color1, const TColor* color2, float alpha,
+                                           float alpha_rate, size_t count) {
+    float result = INFINITY;
+    for (size_t i = 0; i < count; ++i) {
+        float from[4], to[4];
+        rgbw_output_units(color1[i], from);
+        rgbw_output_units(color2[i], to);
+        for (int j = 0; j < 4; ++j) {
+            float value = from[j] + (to[j] - from[j]) * alpha;
+            float rate = (to[j] - from[j]) * alpha_rate; // per second
+            float time;
+            if (rate > 0 && value < 255.f)
+                time = (floorf(value) + 1 - value) / rate; // up to the next step
+            else if (rate < 0 && value > 0.f)
+                time = (value - floorf(value)) / -rate; // down below the current step
+            else
+                continue; // constant or clamped
+            result = std::min(result, time);
+        }
+    }
+    return result;
+}
+
+#ifdef LIGHTD_FIXED_POINT
+typedef rgbw16_t color_t;
+#else
+typedef rgbw_t color_t;
+#endif
+
+// Conversions between the user-facing float colors and color_t
+static inline color_t to_color(rgbw_t color) {
+#ifdef LIGHTD_FIXED_POINT
+    return {
+        .w = rgbw16_from_float(color.w),
+        .r = rgbw16_from_float(color.r),
+        .g = rgbw16_from_float(color.g),
+        .b = rgbw16_from_float(color.b),
+    };
+#else
+    return color;
+#endif
+}
+
+static inline rgbw_t to_rgbw(rgbw_t color) {
+    return color;
+}
+
+static inline rgbw_t to_rgbw(rgbw16_t color) {
+    return {
+        .w = color.w / static_cast<float>(RGBW16_ONE),
+        .r = color.r / static_cast<float>(RGBW16_ONE),
+        .g = color.g / static_cast<float>(RGBW16_ONE),
+        .b = color.b / static_cast<float>(RGBW16_ONE),
+    };
+}
+
+#endif // __COLOR_KERNELS_HPP
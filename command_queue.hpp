@@ -0,0 +1,69 @@
+#ifndef __COMMAND_QUEUE_HPP
+#define __COMMAND_QUEUE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Bounded lock-free queue for any number of producers and a single consumer.
+// Each cell carries a sequence number that tells whether it's free for the
+// producer at a given position or holds data for the consumer at that
+// position (D. Vyukov's bounded queue). Neither side ever waits for the
+// other, push() fails if the queue is full.
+template<typename T, size_t CAPACITY>
+class MpscQueue {
+    static_assert(CAPACITY >= 2 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+    MpscQueue() {
+        for (size_t i = 0; i < CAPACITY; ++i)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Can be called from any thread. Returns false if the queue is full.
+    bool push(const T& data) {
+        Cell* cell;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells_[pos & (CAPACITY - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                // the cell is free, try to claim it
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false; // the consumer hasn't taken the item from the last round yet
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed); // another producer was faster
+            }
+        }
+        cell->data = data;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Must only be called from the consumer thread. Returns false if the queue is empty.
+    bool pop(T* data) {
+        Cell* cell = &cells_[dequeue_pos_ & (CAPACITY - 1)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence != dequeue_pos_ + 1)
+            return false; // empty, or the producer of this cell isn't done yet
+        *data = cell->data;
+        cell->sequence.store(dequeue_pos_ + CAPACITY, std::memory_order_release);
+        dequeue_pos_++;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    Cell cells_[CAPACITY];
+    std::atomic<size_t> enqueue_pos_{0};
+    size_t dequeue_pos_ = 0; // only used by the consumer
+};
+
+#endif // __COMMAND_QUEUE_HPP
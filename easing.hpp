@@ -0,0 +1,61 @@
+#ifndef __EASING_HPP
+#define __EASING_HPP
+
+#include <stdint.h>
+
+// The values are part of the Fibre interface
+enum Easing : uint32_t {
+    EASE_LINEAR = 0,
+    EASE_IN = 1,     // starts slow: t^2
+    EASE_OUT = 2,    // ends slow: 1 - (1 - t)^2
+    EASE_IN_OUT = 3, // starts and ends slow: 3t^2 - 2t^3
+    EASE_STEP = 4,   // holds the start value until the end
+    EASE_COUNT
+};
+
+// Easing curves sampled at SIZE + 1 points, so evaluating one is a lookup and
+// a linear interpolation. Between two samples a curve is a straight line,
+// which lets the caller know how long the current slope holds. For the
+// straight curves that's until the end.
+class EasingTable {
+public:
+    static constexpr unsigned SIZE = 256;
+
+    EasingTable() {
+        for (unsigned i = 0; i <= SIZE; ++i) {
+            float t = static_cast<float>(i) / SIZE;
+            values_[EASE_LINEAR][i] = t;
+            values_[EASE_IN][i] = t * t;
+            values_[EASE_OUT][i] = 1 - (1 - t) * (1 - t);
+            values_[EASE_IN_OUT][i] = t * t * (3 - 2 * t);
+            values_[EASE_STEP][i] = 0;
+        }
+        for (unsigned e = 0; e < EASE_COUNT; ++e) {
+            slope_end_[e][SIZE - 1] = SIZE;
+            for (unsigned i = SIZE - 1; i-- > 0; ) {
+                bool same_slope = values_[e][i + 1] - values_[e][i] == values_[e][i + 2] - values_[e][i + 1];
+                slope_end_[e][i] = same_slope ? slope_end_[e][i + 1] : i + 1;
+            }
+        }
+    }
+
+    // Evaluates the curve at t in [0, 1). Also returns the slope at t and
+    // how much further t can go until the slope changes.
+    float evaluate(Easing easing, float t, float* slope, float* slope_valid_for) const {
+        if (easing >= EASE_COUNT)
+            easing = EASE_LINEAR;
+        const float* values = values_[easing];
+        float x = t * SIZE;
+        unsigned i = x < SIZE ? static_cast<unsigned>(x) : SIZE - 1;
+        float delta = values[i + 1] - values[i];
+        *slope = delta * SIZE;
+        *slope_valid_for = (slope_end_[easing][i] - x) / SIZE;
+        return values[i] + delta * (x - i);
+    }
+
+private:
+    float values_[EASE_COUNT][SIZE + 1];
+    uint16_t slope_end_[EASE_COUNT][SIZE]; // first sample after i where the slope changes
+};
+
+#endif // __EASING_HPP
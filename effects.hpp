@@ -0,0 +1,279 @@
+#ifndef __EFFECTS_HPP
+#define __EFFECTS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+
+#include <fibre/fibre.hpp>
+
+// Procedural effects. Each kernel computes a whole strip per call into one
+// float array per channel, with plain loops over the LEDs and no branches
+// that depend on the data, so the compiler can vectorize them.
+
+// The values are part of the Fibre interface
+enum Effect : uint32_t {
+    EFFECT_RAINBOW = 0, // hues that scroll along the strip
+    EFFECT_CHASE = 1,   // pulses of color that run along the strip
+    EFFECT_TWINKLE = 2, // LEDs that light up at random and fade out
+    EFFECT_FIRE = 3,    // flames that rise from the start of the strip
+    EFFECT_NOISE = 4,   // smooth random brightness that drifts along the strip
+    EFFECT_COUNT
+};
+
+// Settings of an effect, as the kernels see them during one frame
+struct EffectValues {
+    float speed = 1;      // rainbow: hue cycles/s, chase: LEDs/s, twinkle: fade rate [1/s],
+                          // fire: flicker rate, noise: noise cells/s
+    float size = 30;      // [LEDs] rainbow: length of a hue cycle, chase: distance between
+                          // pulses, noise: size of a noise cell
+    float density = 0.3f; // chase: pulse length relative to size, twinkle: new twinkles
+                          // per LED and s, fire: sparks, 1 is 30/s
+    float brightness = 1;
+    // color of chase, twinkle and noise
+    float white = 0;
+    float red = 1;
+    float green = 1;
+    float blue = 1;
+};
+
+// Settings of the running effect. Written by Fibre, read by the render thread
+// every frame, so changes apply right away. The fields are atomics because
+// both threads use them at the same time.
+class EffectParameters {
+public:
+    EffectParameters() {
+        const EffectValues defaults;
+        speed.store(defaults.speed, std::memory_order_relaxed);
+        size.store(defaults.size, std::memory_order_relaxed);
+        density.store(defaults.density, std::memory_order_relaxed);
+        brightness.store(defaults.brightness, std::memory_order_relaxed);
+        white.store(defaults.white, std::memory_order_relaxed);
+        red.store(defaults.red, std::memory_order_relaxed);
+        green.store(defaults.green, std::memory_order_relaxed);
+        blue.store(defaults.blue, std::memory_order_relaxed);
+    }
+
+    // A frame can mix old and new values of a change that is in progress
+    EffectValues load() const {
+        EffectValues values;
+        values.speed = speed.load(std::memory_order_relaxed);
+        values.size = size.load(std::memory_order_relaxed);
+        values.density = density.load(std::memory_order_relaxed);
+        values.brightness = brightness.load(std::memory_order_relaxed);
+        values.white = white.load(std::memory_order_relaxed);
+        values.red = red.load(std::memory_order_relaxed);
+        values.green = green.load(std::memory_order_relaxed);
+        values.blue = blue.load(std::memory_order_relaxed);
+        return values;
+    }
+
+    std::atomic<float> speed;
+    std::atomic<float> size;
+    std::atomic<float> density;
+    std::atomic<float> brightness;
+    std::atomic<float> white;
+    std::atomic<float> red;
+    std::atomic<float> green;
+    std::atomic<float> blue;
+
+    FIBRE_EXPORTS(EffectParameters,
+        make_fibre_property("speed", &speed),
+        make_fibre_property("size", &size),
+        make_fibre_property("density", &density),
+        make_fibre_property("brightness", &brightness),
+        make_fibre_property("white", &white),
+        make_fibre_property("red", &red),
+        make_fibre_property("green", &green),
+        make_fibre_property("blue", &blue)
+    );
+};
+
+// Fractional part, also for negative x. Unlike floorf, this vectorizes without SSE4.1.
+// x must be finite. Floats beyond 2^23 have no fractional part, so x is
+// clamped to that before it's converted to an integer.
+static inline float effect_fract(float x) {
+    x = std::min(std::max(x, -8388608.f), 8388608.f);
+    float f = x - static_cast<float>(static_cast<int32_t>(x));
+    return f < 0 ? f + 1 : f;
+}
+
+static inline float effect_clamp(float x) {
+    return std::min(std::max(x, 0.f), 1.f);
+}
+
+// Maps any integer to an evenly distributed random value in [0, 1)
+static inline float effect_random(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return (x >> 8) * (1.f / (1 << 24));
+}
+
+template<size_t COUNT>
+class EffectRenderer {
+public:
+    // Renders the next frame, dt [s] after the previous one
+    void render(Effect effect, const EffectParameters& parameters, float dt) {
+        // the parameters can change at any time, so they don't change halfway through a frame
+        EffectValues p = parameters.load();
+        sanitize(&p);
+        p.size = std::max(p.size, 1.f);
+        // advance the position instead of deriving it from the time, so speed changes don't jump
+        phase_ = effect_fract(phase_ + dt * p.speed / (effect == EFFECT_RAINBOW ? 1 : p.size));
+        position_ = fmodf(position_ + dt * p.speed, NOISE_PERIOD);
+        if (position_ < 0)
+            position_ += NOISE_PERIOD; // the noise grid has no negative cells
+        frame_++;
+
+        switch (effect) {
+            case EFFECT_RAINBOW: rainbow(p); break;
+            case EFFECT_CHASE: chase(p); break;
+            case EFFECT_TWINKLE: twinkle(p, dt); break;
+            case EFFECT_FIRE: fire(p, dt); break;
+            case EFFECT_NOISE: noise(p); break;
+            default: clear(); break;
+        }
+    }
+
+    // The last frame, one array per channel
+    alignas(16) float w[COUNT];
+    alignas(16) float r[COUNT];
+    alignas(16) float g[COUNT];
+    alignas(16) float b[COUNT];
+
+private:
+    // Fibre can write anything, NaN and inf fall back to the defaults
+    static void sanitize(EffectValues* p) {
+        static const EffectValues defaults;
+        float* values[] = { &p->speed, &p->size, &p->density, &p->brightness, &p->white, &p->red, &p->green, &p->blue };
+        const float* default_values[] = { &defaults.speed, &defaults.size, &defaults.density, &defaults.brightness,
+                                          &defaults.white, &defaults.red, &defaults.green, &defaults.blue };
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+            if (!std::isfinite(*values[i]))
+                *values[i] = *default_values[i];
+        }
+    }
+
+    void clear() {
+        for (size_t i = 0; i < COUNT; ++i)
+            w[i] = r[i] = g[i] = b[i] = 0;
+    }
+
+    // Fills all channels with the color times level[i]
+    void tint(const EffectValues& p, const float* level) {
+        for (size_t i = 0; i < COUNT; ++i) {
+            float l = level[i] * p.brightness;
+            w[i] = p.white * l;
+            r[i] = p.red * l;
+            g[i] = p.green * l;
+            b[i] = p.blue * l;
+        }
+    }
+
+    void rainbow(const EffectValues& p) {
+        float step = 1 / p.size;
+        for (size_t i = 0; i < COUNT; ++i) {
+            // HSV to RGB at full saturation without branches
+            float hue = effect_fract(i * step - phase_) * 6;
+            w[i] = 0;
+            r[i] = effect_clamp(fabsf(hue - 3) - 1) * p.brightness;
+            g[i] = effect_clamp(2 - fabsf(hue - 2)) * p.brightness;
+            b[i] = effect_clamp(2 - fabsf(hue - 4)) * p.brightness;
+        }
+    }
+
+    void chase(const EffectValues& p) {
+        float step = 1 / p.size;
+        float length = std::max(p.density, step); // at least one LED
+        for (size_t i = 0; i < COUNT; ++i) {
+            // how far behind the head of the next pulse, relative to size
+            float distance = effect_fract(phase_ - i * step);
+            level_[i] = std::max(1 - distance / length, 0.f);
+        }
+        tint(p, level_);
+    }
+
+    void twinkle(const EffectValues& p, float dt) {
+        float fade = expf(-fabsf(p.speed) * dt); // a negative speed would make them grow
+        float chance = p.density * dt;
+        uint32_t seed = frame_ * static_cast<uint32_t>(COUNT);
+        for (size_t i = 0; i < COUNT; ++i) {
+            float spawn = effect_random(seed + i) < chance ? 1.f : 0.f;
+            level_[i] = std::max(level_[i] * fade, spawn);
+        }
+        tint(p, level_);
+    }
+
+    void fire(const EffectValues& p, float dt) {
+        float rate = std::min(fabsf(p.speed) * dt * 10, 1.f);
+        float cooling = rate * (0.02f + 3.f / COUNT); // longer strips have taller flames
+        uint32_t seed = frame_ * static_cast<uint32_t>(COUNT);
+
+        // cool down at random and let the heat rise by one LED, into the
+        // second buffer so each LED only depends on the last frame
+        float* heat = heat_[current_heat_];
+        float* next = heat_[!current_heat_];
+        for (size_t i = 0; i < COUNT; ++i) {
+            float below = i >= 1 ? heat[i - 1] : heat[i];
+            float two_below = i >= 2 ? heat[i - 2] : below;
+            float rising = (heat[i] + below + two_below * 2) * 0.25f;
+            float cooled = heat[i] + (rising - heat[i]) * rate - effect_random(seed + i) * cooling;
+            next[i] = std::max(cooled, 0.f);
+        }
+        current_heat_ = !current_heat_;
+
+        // a new spark near the start
+        if (effect_random(seed + COUNT) < p.density * 30 * dt) {
+            size_t i = static_cast<size_t>(effect_random(seed + COUNT + 1) * std::min(COUNT, static_cast<size_t>(7)));
+            next[i] = std::min(next[i] + 0.6f + 0.4f * effect_random(seed + COUNT + 2), 1.f);
+        }
+
+        // black, red, yellow, white
+        for (size_t i = 0; i < COUNT; ++i) {
+            float t = next[i] * 3;
+            w[i] = 0;
+            r[i] = effect_clamp(t) * p.brightness;
+            g[i] = effect_clamp(t - 1) * p.brightness;
+            b[i] = effect_clamp(t - 2) * p.brightness;
+        }
+    }
+
+    void noise(const EffectValues& p) {
+        // value noise: random values on a grid of cells, smoothly interpolated,
+        // with a second octave at twice the resolution for detail. The grid
+        // repeats after NOISE_PERIOD cells, so position_ can wrap around.
+        float step = 1 / p.size;
+        for (size_t i = 0; i < COUNT; ++i) {
+            float value = 0;
+            for (uint32_t octave = 0; octave < 2; ++octave) {
+                float x = (i * step + position_) * (1 << octave);
+                uint32_t cell = static_cast<uint32_t>(x);
+                float f = x - cell;
+                f = f * f * (3 - 2 * f);
+                uint32_t mask = (NOISE_PERIOD << octave) - 1;
+                float v0 = effect_random((cell & mask) + (octave << 16));
+                float v1 = effect_random(((cell + 1) & mask) + (octave << 16));
+                value += (v0 + (v1 - v0) * f) / (1 << octave);
+            }
+            level_[i] = value * (1 / 1.5f);
+        }
+        tint(p, level_);
+    }
+
+    static constexpr uint32_t NOISE_PERIOD = 4096; // [cells]
+
+    float phase_ = 0; // [0, 1) position of the scrolling effects
+    float position_ = 0; // [cells] position of the noise field
+    uint32_t frame_ = 0;
+    alignas(16) float level_[COUNT] = {}; // brightness of chase, twinkle and noise
+    alignas(16) float heat_[2][COUNT] = {};
+    bool current_heat_ = 0;
+};
+
+#endif // __EFFECTS_HPP
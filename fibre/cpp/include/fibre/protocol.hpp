@@ -12,10 +12,13 @@ see protocol.md for the protocol specification
 // TODO: resolve assert
 #define assert(expr)
 
+#include <array>
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <vector>
 //#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include "stream.hpp"
 #include "crc.hpp"
@@ -262,6 +265,25 @@ void default_readwrite_endpoint_handler(T* value, const uint8_t* input, size_t i
         read_le<T>(value, input);
 }
 
+// Atomic properties, for values that another thread uses at the same time.
+// They are accessed with relaxed ordering and look like plain T on the wire.
+template<typename T>
+void default_readwrite_endpoint_handler(const std::atomic<T>* value, const uint8_t* input, size_t input_length, StreamSink* output) {
+    T plain_value = value->load(std::memory_order_relaxed);
+    default_readwrite_endpoint_handler<T>(const_cast<const T*>(&plain_value), input, input_length, output);
+}
+
+template<typename T>
+void default_readwrite_endpoint_handler(std::atomic<T>* value, const uint8_t* input, size_t input_length, StreamSink* output) {
+    default_readwrite_endpoint_handler(const_cast<const std::atomic<T>*>(value), input, input_length, output);
+
+    if (input_length >= sizeof(T)) {
+        T plain_value;
+        read_le<T>(&plain_value, input);
+        value->store(plain_value, std::memory_order_relaxed);
+    }
+}
+
 
 
 template<typename T>
@@ -276,6 +298,14 @@ inline constexpr const char* get_default_json_modifier<float>() {
     return "\"type\":\"float\",\"access\":\"rw\"";
 }
 template<>
+inline constexpr const char* get_default_json_modifier<const std::atomic<float>>() {
+    return "\"type\":\"float\",\"access\":\"r\"";
+}
+template<>
+inline constexpr const char* get_default_json_modifier<std::atomic<float>>() {
+    return "\"type\":\"float\",\"access\":\"rw\"";
+}
+template<>
 inline constexpr const char* get_default_json_modifier<const uint64_t>() {
     return "\"type\":\"uint64\",\"access\":\"r\"";
 }
@@ -300,6 +330,14 @@ inline constexpr const char* get_default_json_modifier<uint32_t>() {
     return "\"type\":\"uint32\",\"access\":\"rw\"";
 }
 template<>
+inline constexpr const char* get_default_json_modifier<const std::atomic<uint32_t>>() {
+    return "\"type\":\"uint32\",\"access\":\"r\"";
+}
+template<>
+inline constexpr const char* get_default_json_modifier<std::atomic<uint32_t>>() {
+    return "\"type\":\"uint32\",\"access\":\"rw\"";
+}
+template<>
 inline constexpr const char* get_default_json_modifier<const uint16_t>() {
     return "\"type\":\"uint16\",\"access\":\"r\"";
 }
@@ -762,17 +800,17 @@ public:
         output_properties_.register_endpoints(list, id + 1 + decltype(input_properties_)::endpoint_count, length);
     }
 
-    template<typename> std::enable_if_t<sizeof...(TOutputs) == 0>
+    template<typename T> std::enable_if_t<sizeof...(TOutputs) == 0 && std::is_void<T>::value>
     handle_ex() {
         invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
     }
 
-    template<typename> std::enable_if_t<sizeof...(TOutputs) == 1>
+    template<typename T> std::enable_if_t<sizeof...(TOutputs) == 1 && std::is_void<T>::value>
     handle_ex() {
         std::get<0>(out_args_) = invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
     }
     
-    template<typename> std::enable_if_t<sizeof...(TOutputs) >= 2>
+    template<typename T> std::enable_if_t<sizeof...(TOutputs) >= 2 && std::is_void<T>::value>
     handle_ex() {
         out_args_ = invoke_function_with_tuple(*obj_, func_ptr_, in_args_);
     }
@@ -86,28 +86,22 @@ int StreamBasedPacketSink::process_packet(const uint8_t *buffer, size_t length)
     if (length >= 128)
         return -1;
 
-    LOG_FIBRE("send header\r\n");
-    uint8_t header[] = {
-        CANONICAL_PREFIX,
-        static_cast<uint8_t>(length),
-        0
-    };
-    header[2] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, header, 2);
-
-    if (output_.process_bytes(header, sizeof(header), nullptr))
-        return -1;
+    // The packet goes out in one piece, so a stream transport like TCP
+    // doesn't hold back the rest until the peer acknowledges the header
+    uint8_t packet[3 + 127 + 2];
+    packet[0] = CANONICAL_PREFIX;
+    packet[1] = static_cast<uint8_t>(length);
+    packet[2] = calc_crc8<CANONICAL_CRC8_POLYNOMIAL>(CANONICAL_CRC8_INIT, packet, 2);
+
     LOG_FIBRE("send payload:\r\n");
     hexdump(buffer, length);
-    if (output_.process_bytes(buffer, length, nullptr))
-        return -1;
+    memcpy(packet + 3, buffer, length);
 
-    LOG_FIBRE("send crc16\r\n");
     uint16_t crc16 = calc_crc16<CANONICAL_CRC16_POLYNOMIAL>(CANONICAL_CRC16_INIT, buffer, length);
-    uint8_t crc16_buffer[] = {
-        (uint8_t)((crc16 >> 8) & 0xff),
-        (uint8_t)((crc16 >> 0) & 0xff)
-    };
-    if (output_.process_bytes(crc16_buffer, 2, nullptr))
+    packet[3 + length] = (uint8_t)((crc16 >> 8) & 0xff);
+    packet[4 + length] = (uint8_t)((crc16 >> 0) & 0xff);
+
+    if (output_.process_bytes(packet, length + 5, nullptr))
         return -1;
     LOG_FIBRE("sent!\r\n");
     return 0;
@@ -156,45 +156,64 @@ class StreamBasedPacketSink(PacketSink):
         header.append(len(packet))
         header.append(calc_crc8(CRC8_INIT, header))
 
-        self._output.process_bytes(header)
-        self._output.process_bytes(packet)
-
         # append CRC in big endian
         crc16 = calc_crc16(CRC16_INIT, packet)
-        self._output.process_bytes(struct.pack('>H', crc16))
+
+        # in one piece, so stream transports don't hold back the rest of the
+        # packet until the peer acknowledges the first part
+        self._output.process_bytes(bytes(header) + bytes(packet) + struct.pack('>H', crc16))
 
 class PacketFromStreamConverter(PacketSource):
     def __init__(self, input):
         self._input = input
-    
+        self._pending = bytes() # bytes of a packet that wasn't complete before the deadline
+
+    def _fill(self, n_bytes, deadline):
+        """
+        Reads until at least n_bytes are pending. Returns False if the deadline
+        is reached first. What was read so far stays pending, so a packet that
+        straddles the deadline isn't lost.
+        """
+        while len(self._pending) < n_bytes:
+            try:
+                data = self._input.get_bytes(n_bytes - len(self._pending), deadline)
+            except TimeoutError:
+                return False
+            if not data:
+                return False
+            self._pending += data
+        return True
+
     def get_packet(self, deadline):
         """
         Requests bytes from the underlying input stream until a full packet is
-        received or the deadline is reached, in which case None is returned. A
-        deadline before the current time corresponds to non-blocking mode.
+        received or the deadline is reached, in which case TimeoutError is
+        raised. A deadline before the current time corresponds to non-blocking
+        mode.
         """
         while True:
-            header = bytes()
-
-            # TODO: sometimes this call hangs, even though the device apparently sent something
-            header = header + self._input.get_bytes_or_fail(1, deadline)
+            if not self._fill(3, deadline):
+                raise TimeoutError()
+            header = self._pending[:3]
             if (header[0] != SYNC_BYTE):
                 #print("sync byte mismatch")
+                self._pending = self._pending[1:]
                 continue
-
-            header = header + self._input.get_bytes_or_fail(1, deadline)
             if (header[1] & 0x80):
                 #print("packet too large")
+                self._pending = self._pending[1:]
                 continue # TODO: support packets larger than 128 bytes
-
-            header = header + self._input.get_bytes_or_fail(1, deadline)
             if calc_crc8(CRC8_INIT, header) != 0:
                 #print("crc8 mismatch")
+                self._pending = self._pending[1:]
                 continue
 
             packet_length = header[1] + 2
             #print("wait for {} bytes".format(packet_length))
-            packet = self._input.get_bytes_or_fail(packet_length, deadline)
+            if not self._fill(3 + packet_length, deadline):
+                raise TimeoutError()
+            packet = self._pending[3:3 + packet_length]
+            self._pending = self._pending[3 + packet_length:]
             if calc_crc16(CRC16_INIT, packet) != 0:
                 #print("crc16 mismatch")
                 continue
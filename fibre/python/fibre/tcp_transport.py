@@ -69,7 +69,7 @@ class TCPTransport(fibre.protocol.StreamSource, fibre.protocol.StreamSink):
     try:
       data = self.sock.recv(n_bytes, socket.MSG_WAITALL) # receive n_bytes
       return data
-    except socket.timeout:
+    except (socket.timeout, BlockingIOError): # the latter if the deadline already passed
       # if we got a timeout data will still be none, so we call recv again
       # this time in non blocking state and see if we can get some data
       #return self.sock.recv(n_bytes, socket.MSG_DONTWAIT)
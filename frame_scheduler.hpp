@@ -0,0 +1,132 @@
+#ifndef __FRAME_SCHEDULER_HPP
+#define __FRAME_SCHEDULER_HPP
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+// Paces a loop to a fixed frame rate. The deadlines are absolute
+// CLOCK_MONOTONIC times, so the time spent rendering doesn't add to the
+// period and the frame rate doesn't drift.
+// If a frame finishes after its deadline, that's an overrun and the next frame
+// starts right away. If the loop falls behind by whole frames, these frames
+// are skipped instead of being rendered back to back to catch up.
+// When nothing changes, the loop can also idle for longer than a frame until
+// a given time or until another thread calls wake().
+class FrameScheduler {
+public:
+    FrameScheduler(unsigned fps) {
+        set_fps(fps);
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    ~FrameScheduler() {
+        close(wake_fd_);
+        close(timer_fd_);
+    }
+
+    void set_fps(unsigned fps) {
+        period_ns_ = 1000000000ull / (fps ? fps : 1);
+    }
+
+    unsigned get_fps() {
+        return static_cast<unsigned>(1000000000ull / period_ns_);
+    }
+
+    // Makes the next deadline one period from now
+    void start() {
+        start_time_ = now();
+        next_deadline_ = start_time_ + period_ns_;
+        frames_ = 0;
+    }
+
+    // Sleeps until the next frame is due
+    void wait_for_next_frame() {
+        uint64_t time = now();
+        frames_++;
+
+        if (time >= next_deadline_) {
+            overruns_++;
+            uint64_t missed = (time - next_deadline_) / period_ns_;
+            skipped_frames_ += missed;
+            next_deadline_ += (missed + 1) * period_ns_;
+            return;
+        }
+
+        struct timespec deadline = {
+            .tv_sec = static_cast<time_t>(next_deadline_ / 1000000000ull),
+            .tv_nsec = static_cast<long>(next_deadline_ % 1000000000ull)
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR)
+            ;
+        next_deadline_ += period_ns_;
+    }
+
+    // Sleeps until wake_time_ns or until wake() is called, whichever is first.
+    // The next frame is due one period after that.
+    void idle_until(uint64_t wake_time_ns) {
+        struct itimerspec timer = {
+            .it_interval = { 0, 0 },
+            .it_value = {
+                .tv_sec = static_cast<time_t>(wake_time_ns / 1000000000ull),
+                .tv_nsec = static_cast<long>(wake_time_ns % 1000000000ull)
+            }
+        };
+        struct pollfd fds[2] = {
+            { .fd = timer_fd_, .events = POLLIN, .revents = 0 },
+            { .fd = wake_fd_, .events = POLLIN, .revents = 0 }
+        };
+        uint64_t value;
+
+        frames_++;
+        if (!timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &timer, nullptr))
+            poll(fds, 2, -1); // a signal ends the wait early, that's fine
+        // clear both, a wake() that comes in while rendering ends the next idle right away
+        ssize_t result = read(timer_fd_, &value, sizeof(value));
+        result = read(wake_fd_, &value, sizeof(value));
+        (void)result; // fails if nothing was pending
+        next_deadline_ = now() + period_ns_;
+    }
+
+    // Ends idle_until() early, can be called from any thread
+    void wake() {
+        uint64_t value = 1;
+        ssize_t result = write(wake_fd_, &value, sizeof(value));
+        (void)result; // can only fail if the counter is about to overflow
+    }
+
+    uint64_t get_next_deadline() { return next_deadline_; }
+
+    // frames per second since start()
+    float get_achieved_fps() {
+        uint64_t elapsed = now() - start_time_;
+        return elapsed ? frames_ * 1e9f / elapsed : 0;
+    }
+
+    uint64_t get_frames() { return frames_; }
+    uint64_t get_overruns() { return overruns_; }
+    uint64_t get_skipped_frames() { return skipped_frames_; }
+
+    static uint64_t now() {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return static_cast<uint64_t>(time.tv_sec) * 1000000000ull + time.tv_nsec;
+    }
+
+private:
+    uint64_t period_ns_;
+    int wake_fd_;
+    int timer_fd_;
+    uint64_t next_deadline_ = 0;
+    uint64_t start_time_ = 0;
+    uint64_t frames_ = 0;
+    uint64_t overruns_ = 0; // frames that finished after their deadline
+    uint64_t skipped_frames_ = 0; // frames that were left out to catch up
+};
+
+#endif // __FRAME_SCHEDULER_HPP
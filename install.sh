@@ -4,6 +4,7 @@ set -euo pipefail
 ln -sf "$(realpath lightctl.py)" /usr/bin/lightctl
 ln -sf "$(realpath lightd_homekit.py)" /usr/bin/lightd-homekit
 cp systemd/* /etc/systemd/system/
+mkdir -p /var/lib/lightd/animations
 
 #sudo systemctl stop lightd
 cp build/lightd /usr/bin/
@@ -3,6 +3,7 @@
 Set the color on a fibre-enabled light controller.
 """
 import argparse
+import struct
 import sys
 import os
 
@@ -16,20 +17,72 @@ parser.add_argument("-v", "--verbose", action="store_true",
                     help="print debug information")
 parser.add_argument("--host", metavar="HOSTNAME", action="store",
                     help="Specifies the host or IP address of the light controller.")
-parser.add_argument("color", metavar="WWRRGGBB", type=str, nargs=1,
+parser.add_argument("color", metavar="WWRRGGBB", type=str, nargs='?',
                     help="Specifies the color code.")
 parser.add_argument("-t", "--time", metavar="SECONDS", type=float,
                     help="Fade duration. Defaults to 0.")
 parser.add_argument("-l", "--limit-brightness", action="store_true",
                     help="don't increase brightness")
-parser.set_defaults(host="tcp:192.168.178.36:9910", time=0)
+parser.add_argument("-k", "--keyframe", metavar="SECONDS:WWRRGGBB[:EASING]", action="append",
+                    help="Instead of a single color, fade through a list of keyframes. "
+                         "SECONDS is the time since the start. EASING is one of "
+                         "linear (default), in, out, in-out, step.")
+parser.add_argument("--loop", action="store_true",
+                    help="repeat the keyframes or the animation file")
+parser.add_argument("-e", "--effect", choices=['rainbow', 'chase', 'twinkle', 'fire', 'noise'],
+                    help="Instead of a single color, run a procedural effect. Its parameters are in the effect object of each layer, e.g. ledstrip1.overlay.effect.")
+parser.add_argument("-p", "--play", metavar="SLOT", type=int,
+                    help="Instead of a single color, play the animation file in this slot.")
+parser.add_argument("--upload", metavar="FILE", type=str,
+                    help="Upload an animation file into the slot given by --play before playing it. "
+                         "This is slow, copy large files to the animation directory instead.")
+parser.add_argument("--layer", choices=['base', 'overlay', 'flash'],
+                    help="Draw on this layer of both strips. Each layer is blended onto the ones below, "
+                         "see --blend. Defaults to base.")
+parser.add_argument("--blend", metavar="MODE[:ALPHA]", type=str,
+                    help="How the layer is blended onto the ones below. MODE is one of "
+                         "normal, add, multiply, max. ALPHA is in [0, 1] and defaults to 1.")
+parser.add_argument("--clear", action="store_true",
+                    help="make the layer transparent")
+parser.set_defaults(host="tcp:192.168.178.36:9910", time=0, keyframe=[], layer='base')
 args = parser.parse_args()
 
+easings = {'linear': 0, 'in': 1, 'out': 2, 'in-out': 3, 'step': 4}
+blend_modes = {'normal': 0, 'add': 1, 'multiply': 2, 'max': 3}
+
+def parse_color(text):
+  color = int(text, 16)
+  return (float((color >> 24) & 0xff) / 255,
+          float((color >> 16) & 0xff) / 255,
+          float((color >> 8) & 0xff) / 255,
+          float((color >> 0) & 0xff) / 255)
+
 try:
-  color = int(args.color[0], 16)
-except ValueError:
+  contents = [args.color is not None, len(args.keyframe) > 0, args.effect is not None, args.play is not None].count(True)
+  if contents > 1 or (contents == 0 and not args.clear and args.blend is None):
+    raise ValueError("expected either a color code, keyframes, an effect or an animation slot")
+  if args.clear and contents > 0:
+    raise ValueError("--clear can't be combined with new colors")
+  if args.play is not None and args.layer != 'base':
+    raise ValueError("animation files only play on the base layer")
+  if args.upload is not None and args.play is None:
+    raise ValueError("--upload needs a slot from --play")
+  if args.color is not None:
+    color = parse_color(args.color)
+  keyframes = []
+  for keyframe in args.keyframe:
+    fields = keyframe.split(':')
+    if not len(fields) in [2, 3] or (len(fields) == 3 and not fields[2] in easings):
+      raise ValueError("invalid keyframe " + keyframe)
+    keyframes.append((float(fields[0]), parse_color(fields[1]), easings[fields[2] if len(fields) == 3 else 'linear']))
+  if args.blend is not None:
+    fields = args.blend.split(':')
+    if not len(fields) in [1, 2] or not fields[0] in blend_modes:
+      raise ValueError("invalid blend mode " + args.blend)
+    blend = (float(fields[1]) if len(fields) == 2 else 1.0, blend_modes[fields[0]])
+except ValueError as error:
   parser.print_usage(file=sys.stderr)
-  sys.stderr.write("error: expected hexadecimal color code\n")
+  sys.stderr.write("error: " + str(error) + "\n")
   sys.exit(1)
 
 # Connect to device
@@ -39,13 +92,54 @@ else:
   printer = lambda x: None
 lightcontroller = fibre.find_any(path=(args.host), timeout=100)
 
-# Set color
-lightcontroller.set_color(float((color >> 24) & 0xff) / 255,
-                          float((color >> 16) & 0xff) / 255,
-                          float((color >> 8) & 0xff) / 255,
-                          float((color >> 0) & 0xff) / 255,
-                          args.time,
-                          1 if args.limit_brightness else 0)
+# The functions on the top level control the base layer of both strips
+if args.layer == 'base' and args.blend is None and not args.clear:
+  layers = [lightcontroller]
+else:
+  layers = [getattr(lightcontroller.ledstrip1, args.layer), getattr(lightcontroller.ledstrip2, args.layer)]
+
+if args.clear:
+  for layer in layers:
+    layer.clear()
+if args.blend is not None:
+  for layer in layers:
+    layer.set_blend(*blend)
+
+if args.effect is not None:
+  # Run effect
+  for layer in layers:
+    layer.play_effect(['rainbow', 'chase', 'twinkle', 'fire', 'noise'].index(args.effect))
+elif args.play is not None:
+  if args.upload is not None:
+    # Upload in 32 byte chunks
+    with open(args.upload, 'rb') as file:
+      data = file.read()
+    if not lightcontroller.animations.upload_begin(args.play, len(data)):
+      sys.stderr.write("error: upload failed to start\n")
+      sys.exit(1)
+    data += bytes(-len(data) % 32)
+    for offset in range(0, len(data), 32):
+      if not lightcontroller.animations.upload_data(*struct.unpack('<8I', data[offset:offset + 32])):
+        sys.stderr.write("error: upload failed\n")
+        sys.exit(1)
+    if not lightcontroller.animations.upload_finish():
+      sys.stderr.write("error: upload failed, the file might be invalid\n")
+      sys.exit(1)
+  # Play animation file
+  lightcontroller.play_file(args.play, 1 if args.loop else 0)
+elif keyframes:
+  # Play keyframes
+  for layer in layers:
+    layer.clear_keyframes()
+    for time, color, easing in keyframes:
+      layer.add_keyframe(time, *color, easing, 1 if args.limit_brightness else 0)
+    layer.play_keyframes(1 if args.loop else 0)
+elif args.color is not None:
+  # Set color
+  for layer in layers:
+    layer.set_color(*color,
+                    args.time,
+                    1 if args.limit_brightness else 0)
 
 #lightcontroller.ledstrip1.start_music()
 lightcontroller._close()
@@ -1,14 +1,34 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <thread>
+#include <memory>
+#include <algorithm>
 #include <signal.h>
+#include <atomic>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include <fibre/fibre.hpp>
 #include <fibre/posix_tcp.hpp>
 #include <fibre/posix_udp.hpp>
 
 #include "rpi_ws281x/ws2811.h"
+#include "rpi_ws281x/mock.h"
+#include "color_kernels.hpp"
+#include "frame_scheduler.hpp"
+#include "stats.hpp"
+#include "command_queue.hpp"
+#include "published_frame.hpp"
+#include "object_pool.hpp"
+#include "easing.hpp"
+#include "animation_file.hpp"
+#include "effects.hpp"
 
 constexpr unsigned int LEDSTRIP1_LENGTH = 167;
 constexpr unsigned int LEDSTRIP2_LENGTH = 109;
@@ -45,21 +65,6 @@ ws2811_t ledstrip = {
 
 
 
-// TODO: change to L*u*v* color space
-typedef struct {
-    float w, r, g, b;
-} rgbw_t;
-
-// alpha: 0...1 corresponds to color1...color2
-static rgbw_t rgbw_blend(rgbw_t color1, rgbw_t color2, float alpha) {
-    return {
-        .w = color1.w * (1 - alpha) + color2.w * alpha,
-        .r = color1.r * (1 - alpha) + color2.r * alpha,
-        .g = color1.g * (1 - alpha) + color2.g * alpha,
-        .b = color1.b * (1 - alpha) + color2.b * alpha,
-    };
-}
-
 // returns a brightness in [0...1]
 static float get_brightness(rgbw_t &color) {
     // relative brighness of each color channel
@@ -91,112 +96,716 @@ static float get_timespan(struct timespec *time1, struct timespec *time0) {
 
 class Animation {
 public:
-    Animation(size_t num_leds, size_t num_frames, float duration, const rgbw_t* data) :
+    Animation(size_t num_leds, size_t num_frames, float duration, const color_t* data) :
             num_leds_(num_leds),
             num_frames_(num_frames),
             frame_duration_(duration / static_cast<float>(num_frames - 1)),
             data_(data) {}
+    virtual ~Animation() {}
 
-    void draw(struct timespec* timestamp, struct timespec* starttime, rgbw_t* output, size_t output_length) {
+    virtual void draw(struct timespec* timestamp, struct timespec* starttime, color_t* output, size_t output_length) {
         size_t copy_count = std::min(num_leds_, output_length);
+        Position position;
+
+        if (get_position(timestamp, starttime, &position)) {
+            const color_t* frame1 = &data_[position.frame * num_leds_];
+            const color_t* frame2 = &data_[(position.frame + 1) * num_leds_];
+            rgbw_blend_array(frame1, frame2, position.alpha, output, copy_count);
+        } else {
+            memcpy(output, &data_[(num_frames_ - 1) * num_leds_], sizeof(color_t) * copy_count);
+        }
+    }
+
+    // Returns the time in seconds after timestamp when the packed output of
+    // draw() can change next, INFINITY once the animation is over.
+    virtual float get_time_to_next_change(struct timespec* timestamp, struct timespec* starttime, size_t output_length) {
+        size_t count = std::min(num_leds_, output_length);
+        Position position;
+
+        if (!get_position(timestamp, starttime, &position))
+            return INFINITY;
+
+        const color_t* frame1 = &data_[position.frame * num_leds_];
+        const color_t* frame2 = &data_[(position.frame + 1) * num_leds_];
+        return std::min(position.valid_for, rgbw_time_to_next_step(frame1, frame2, position.alpha, position.alpha_rate, count));
+    }
 
+protected:
+    // For subclasses that set num_frames_ once they know it
+    Animation(size_t num_leds, const color_t* data) :
+            num_leds_(num_leds),
+            num_frames_(0),
+            frame_duration_(0),
+            data_(data) {}
+
+    struct Position {
+        size_t frame;     // blend between this frame and the next
+        float alpha;      // weight of the next frame
+        float alpha_rate; // [1/s] change of alpha over time
+        float valid_for;  // [s] how long alpha_rate holds
+    };
+
+    // Returns the frames to blend between and the weight of the second one,
+    // false if the animation is over and only the last frame is left.
+    virtual bool get_position(struct timespec* timestamp, struct timespec* starttime, Position* position) {
         float progress = get_timespan(timestamp, starttime) / frame_duration_;
         if (static_cast<size_t>(progress) < num_frames_ - 1 // prevent out-of-bounds access
             && progress < static_cast<float>(num_frames_ - 1)) { // evaluates to false for inf and NaN
-            size_t frame_num = static_cast<size_t>(progress); // [0, num_frames)
-            progress -= frame_num; // [0, 1)
-            const rgbw_t* frame1 = &data_[frame_num * num_leds_];
-            const rgbw_t* frame2 = &data_[(frame_num + 1) * num_leds_];
-            for (size_t i = 0; i < copy_count; ++i)
-                output[i] = rgbw_blend(frame1[i], frame2[i], progress);
-        } else {
-            memcpy(output, &data_[(num_frames_ - 1) * num_leds_], sizeof(rgbw_t) * copy_count);
+            position->frame = static_cast<size_t>(progress); // [0, num_frames)
+            position->alpha = progress - position->frame; // [0, 1)
+            position->alpha_rate = 1 / frame_duration_;
+            position->valid_for = (1 - position->alpha) * frame_duration_; // the next frames blend at a different rate
+            return true;
         }
+        return false;
     }
 
-private:
     size_t num_leds_;
     size_t num_frames_;
     float frame_duration_; // [s]
-    const rgbw_t* data_;
+    const color_t* data_;
 };
 
 template<unsigned COUNT>
 class FadeToColorAnimation : public Animation {
 public:
-    FadeToColorAnimation(const rgbw_t* current, size_t num_leds, rgbw_t target, float duration, bool should_limit_brightness)
-        : Animation(num_leds, 2, duration, reinterpret_cast<const rgbw_t*>(start_and_end)) {
-        size_t count = std::min(num_leds, COUNT);
+    FadeToColorAnimation(const color_t* current, size_t num_leds, rgbw_t target, float duration, bool should_limit_brightness)
+        : Animation(num_leds, 2, duration, reinterpret_cast<const color_t*>(start_and_end)) {
+        size_t count = std::min(num_leds, static_cast<size_t>(COUNT));
+        color_t end_color = to_color(target);
         for (size_t i = 0; i < count; ++i) {
             start_and_end[0][i] = current[i];
-            start_and_end[1][i] = should_limit_brightness ? limit_brightness(target, current[i]) : target;
+            start_and_end[1][i] = should_limit_brightness ? to_color(limit_brightness(target, to_rgbw(current[i]))) : end_color;
+        }
+    }
+    color_t start_and_end[2][COUNT];
+};
+
+static const EasingTable easing_table;
+
+constexpr size_t MAX_KEYFRAMES = 16;
+
+struct Keyframe {
+    float time; // [s] since the start of the animation
+    rgbw_t color;
+    Easing easing; // of the transition from the previous keyframe
+    bool limit_brightness; // relative to the colors when the animation starts
+};
+
+// Fades through a list of keyframes at arbitrary times. If the first
+// keyframe is after 0 s, the animation starts at the current colors. When
+// looping, it jumps back to the first keyframe after the last one.
+template<unsigned COUNT>
+class KeyframeAnimation : public Animation {
+public:
+    KeyframeAnimation(const color_t* current, size_t num_leds, const Keyframe* keyframes, size_t num_keyframes, bool loop)
+            : Animation(std::min(num_leds, static_cast<size_t>(COUNT)), reinterpret_cast<const color_t*>(frames_)) {
+        size_t frame = 0;
+        if (!num_keyframes || keyframes[0].time > 0) {
+            memcpy(frames_[0], current, sizeof(color_t) * num_leds_);
+            times_[0] = 0;
+            easings_[0] = EASE_LINEAR;
+            frame++;
+        }
+        loop_start_ = loop ? frame : SIZE_MAX;
+        for (size_t i = 0; i < num_keyframes && i < MAX_KEYFRAMES; ++i, ++frame) {
+            color_t color = to_color(keyframes[i].color);
+            for (size_t j = 0; j < num_leds_; ++j)
+                frames_[frame][j] = keyframes[i].limit_brightness ? to_color(limit_brightness(keyframes[i].color, to_rgbw(current[j]))) : color;
+            times_[frame] = std::max(keyframes[i].time, frame ? times_[frame - 1] : 0.0f); // keep them in order
+            easings_[frame] = keyframes[i].easing;
         }
+        num_frames_ = frame;
+        if (loop_start_ >= num_frames_ - 1 || times_[num_frames_ - 1] <= times_[loop_start_])
+            loop_start_ = SIZE_MAX; // nothing to repeat
+    }
+
+protected:
+    bool get_position(struct timespec* timestamp, struct timespec* starttime, Position* position) override {
+        size_t last = num_frames_ - 1;
+        float time = static_cast<float>((timestamp->tv_sec - starttime->tv_sec) + (timestamp->tv_nsec - starttime->tv_nsec) * 1e-9);
+
+        if (loop_start_ != SIZE_MAX && time >= times_[last]) {
+            float period = times_[last] - times_[loop_start_];
+            time = times_[loop_start_] + fmodf(time - times_[loop_start_], period);
+        }
+        if (!(time < times_[last]))
+            return false;
+
+        // The time only moves forward, except when looping, so the cursor
+        // usually stays put or moves by one keyframe
+        if (time < times_[cursor_])
+            cursor_ = loop_start_ != SIZE_MAX && time >= times_[loop_start_] ? loop_start_ : 0;
+        while (time >= times_[cursor_ + 1])
+            cursor_++;
+
+        float segment_duration = times_[cursor_ + 1] - times_[cursor_];
+        float slope, slope_valid_for;
+        position->frame = cursor_;
+        position->alpha = easing_table.evaluate(easings_[cursor_ + 1], (time - times_[cursor_]) / segment_duration, &slope, &slope_valid_for);
+        position->alpha_rate = slope / segment_duration;
+        position->valid_for = slope_valid_for * segment_duration;
+        return true;
     }
-    rgbw_t start_and_end[2][COUNT];
+
+private:
+    // one more for the current colors
+    color_t frames_[MAX_KEYFRAMES + 1][COUNT];
+    float times_[MAX_KEYFRAMES + 1];
+    Easing easings_[MAX_KEYFRAMES + 1];
+    size_t loop_start_;
+    size_t cursor_ = 0;
 };
 
+// Runs a procedural effect until another animation replaces it. The
+// parameters are read every frame, so they can be changed while it runs.
+template<unsigned COUNT>
+class EffectAnimation : public Animation {
+public:
+    EffectAnimation(size_t num_leds, Effect effect, const EffectParameters* parameters)
+        : Animation(std::min(num_leds, static_cast<size_t>(COUNT)), nullptr),
+          effect_(effect), parameters_(parameters) {}
+
+    void draw(struct timespec* timestamp, struct timespec* starttime, color_t* output, size_t output_length) override {
+        float time = static_cast<float>((timestamp->tv_sec - starttime->tv_sec) + (timestamp->tv_nsec - starttime->tv_nsec) * 1e-9);
+        renderer_.render(effect_, *parameters_, std::max(time - last_time_, 0.f));
+        last_time_ = time;
+        rgbw_interleave_array(renderer_.w, renderer_.r, renderer_.g, renderer_.b, output, std::min(num_leds_, output_length));
+    }
+
+    float get_time_to_next_change(struct timespec*, struct timespec*, size_t) override {
+        return 0; // every frame
+    }
+
+private:
+    Effect effect_;
+    const EffectParameters* parameters_;
+    EffectRenderer<COUNT> renderer_;
+    float last_time_ = 0;
+};
+
+FrameScheduler scheduler(100);
+AnimationStore animation_store;
+
+// The layers of each LED strip, from the bottom up
+enum : uint8_t {
+    LAYER_BASE = 0,    // the scene, also where animation files play
+    LAYER_OVERLAY = 1, // e.g. an effect on top of the scene
+    LAYER_FLASH = 2,   // e.g. a notification
+    LAYER_COUNT
+};
+
+// The LEDs show a stack of layers. Each layer runs its own animations into
+// its own image and is blended onto the layers below with its alpha and
+// blend mode. A layer only renders while its animation runs, and the blended
+// result of each layer is kept, so a frame only recomputes the layers from
+// the lowest one that changed upwards.
 template<unsigned COUNT>
 class LEDController {
 public:
+    class Layer {
+    public:
+        void set_color(float white, float red, float green, float blue, float duration, bool limit_brightness) {
+            printf("set_color\n");
+            Command command = {
+                .type = Command::FADE,
+                .layer = index_,
+                .fade = {
+                    .target = { .w = white, .r = red, .g = green, .b = blue },
+                    .duration = duration,
+                    .limit_brightness = limit_brightness
+                }
+            };
+            controller_->send(command);
+        }
+
+        // Starts one of the Effect values, with the parameters in this layer's
+        // effect object. Returns false if the effect doesn't exist.
+        bool play_effect(uint32_t effect) {
+            printf("play_effect\n");
+            if (effect >= EFFECT_COUNT) {
+                fprintf(stderr, "unknown effect %u\n", effect);
+                return false;
+            }
+            Command command = { .type = Command::START_EFFECT, .layer = index_, .effect = static_cast<Effect>(effect) };
+            return controller_->send(command);
+        }
+
+        // Appends a keyframe to the next play_keyframes() animation. time is in
+        // seconds since the animation starts and must not decrease from one
+        // keyframe to the next. easing is one of the Easing values.
+        void add_keyframe(float time, float white, float red, float green, float blue, uint32_t easing, bool limit_brightness) {
+            Command command = {
+                .type = Command::ADD_KEYFRAME,
+                .layer = index_,
+                .keyframe = {
+                    .time = time,
+                    .color = { .w = white, .r = red, .g = green, .b = blue },
+                    .easing = static_cast<Easing>(easing),
+                    .limit_brightness = limit_brightness
+                }
+            };
+            controller_->send(command);
+        }
+
+        // Forgets the keyframes added so far
+        void clear_keyframes() {
+            Command command = { .type = Command::CLEAR_KEYFRAMES, .layer = index_ };
+            controller_->send(command);
+        }
+
+        // Starts an animation through the keyframes added so far and clears them
+        void play_keyframes(bool loop) {
+            printf("play_keyframes\n");
+            Command command = { .type = Command::PLAY_KEYFRAMES, .layer = index_, .loop = loop };
+            controller_->send(command);
+        }
+
+        // Sets how the layer is drawn onto the layers below. alpha is in
+        // [0, 1], blend_mode is one of the BlendMode values.
+        void set_blend(float alpha, uint32_t blend_mode) {
+            if (blend_mode > BLEND_MAX) {
+                fprintf(stderr, "unknown blend mode %u\n", blend_mode);
+                return;
+            }
+            Command command = {
+                .type = Command::SET_BLEND,
+                .layer = index_,
+                .blend = { .alpha = alpha, .mode = static_cast<BlendMode>(blend_mode) }
+            };
+            controller_->send(command);
+        }
+
+        // Stops the layer's animation and makes it transparent until the next one
+        void clear() {
+            printf("clear\n");
+            Command command = { .type = Command::CLEAR_LAYER, .layer = index_ };
+            controller_->send(command);
+        }
+
+        // written by the render thread, read by Fibre
+        std::atomic<float> alpha_{1};
+        std::atomic<uint32_t> blend_mode_{BLEND_NORMAL};
+        EffectParameters effect_parameters_; // written by Fibre, read by the render thread
+
+        FIBRE_EXPORTS(Layer,
+            make_fibre_function("set_color", *obj, &Layer::set_color, "white", "red", "green", "blue", "duration", "limit_brightness"),
+            make_fibre_function("add_keyframe", *obj, &Layer::add_keyframe, "time", "white", "red", "green", "blue", "easing", "limit_brightness"),
+            make_fibre_function("clear_keyframes", *obj, &Layer::clear_keyframes),
+            make_fibre_function("play_keyframes", *obj, &Layer::play_keyframes, "loop"),
+            make_fibre_function("play_effect", *obj, &Layer::play_effect, "effect"),
+            make_fibre_object("effect", effect_parameters_.make_fibre_definitions()),
+            make_fibre_function("set_blend", *obj, &Layer::set_blend, "alpha", "blend_mode"),
+            make_fibre_ro_property("alpha", &alpha_),
+            make_fibre_ro_property("blend_mode", &blend_mode_),
+            make_fibre_function("clear", *obj, &Layer::clear)
+        );
+
+    private:
+        friend class LEDController;
+
+        // the render thread is the only writer, so it needs no ordering
+        float alpha() const { return alpha_.load(std::memory_order_relaxed); }
+        BlendMode blend_mode() const { return static_cast<BlendMode>(blend_mode_.load(std::memory_order_relaxed)); }
+        bool is_visible() { return active_ && alpha() > 0; }
+
+        LEDController* controller_ = nullptr;
+        uint8_t index_ = 0;
+        // Everything below is only used by the render thread
+        PoolPtr<Animation> animation_;
+        struct timespec animation_start_; // time when the animation started
+        Keyframe keyframes_[MAX_KEYFRAMES]; // for the next play_keyframes()
+        size_t num_keyframes_ = 0;
+        bool active_ = false; // false while the layer is cleared
+        bool changed_ = true; // the image, alpha or blend mode changed since the last frame
+        color_t image_[COUNT] = {}; // the layer's own colors, before blending
+    };
+
     LEDController() {
+        for (uint8_t i = 0; i < LAYER_COUNT; ++i) {
+            layers_[i].controller_ = this;
+            layers_[i].index_ = i;
+        }
+        layers_[LAYER_BASE].active_ = true;
     }
 
-    void start_fade(rgbw_t target, float duration, bool should_limit_brightness = 0) {
-        // TODO: thread safety
-        if (clock_gettime(CLOCK_MONOTONIC, &animation_start_)) {
-            fprintf(stderr, "clock failed\n");
+    // Must only be called from the render thread, others use set_color
+    void start_fade(Layer& layer, rgbw_t target, float duration, bool should_limit_brightness = 0) {
+        if (!start_animation(layer))
             return;
-        }
-
-        animation_ = std::make_shared<FadeToColorAnimation<COUNT>>(
-            img_current_, COUNT,
+        layer.animation_ = fade_pool_.template create<Animation>(
+            layer.image_, COUNT,
             target, duration, should_limit_brightness
         );
     }
 
-    void render(ws2811_led_t *leds) {
-        render();
-        for (size_t i = 0; i < COUNT; ++i) {
-            rgbw_t *color = &img_current_[i];
-            leds[i] = ((uint32_t)(to_uint8(color->w) << 24) + (uint32_t)(to_uint8(color->r) << 16) +
-                      (uint32_t)(to_uint8(color->g) << 8) + (uint32_t)(to_uint8(color->b) << 0));
+    // Must only be called from the render thread, others use play_keyframes
+    void start_keyframes(Layer& layer, const Keyframe* keyframes, size_t num_keyframes, bool loop) {
+        if (!start_animation(layer))
+            return;
+        layer.animation_ = keyframe_pool_.template create<Animation>(
+            layer.image_, COUNT,
+            keyframes, num_keyframes, loop
+        );
+    }
+
+    // Must only be called from the render thread, others use play_effect
+    void start_effect(Layer& layer, Effect effect) {
+        if (!start_animation(layer))
+            return;
+        layer.animation_ = effect_pool_.template create<Animation>(COUNT, effect, &layer.effect_parameters_);
+    }
+
+    // Must only be called from the render thread, others use clear
+    void clear_layer(Layer& layer) {
+        if (&layer == &layers_[LAYER_BASE])
+            end_file();
+        layer.animation_.reset();
+        layer.active_ = false;
+        layer.changed_ = true;
+        memset(layer.image_, 0, sizeof(layer.image_)); // the next animation starts from black
+    }
+
+    // Must only be called from the render thread, others use play_file.
+    // Files always play on the base layer.
+    void start_file(AnimationFile* file, bool loop) {
+        Layer& base = layers_[LAYER_BASE];
+        if (!start_animation(base)) {
+            retire_file(file);
+            return;
         }
+        // LEDs beyond the end of the file keep their colors
+        rgbw_pack_array(base.image_, file_frame_, COUNT);
+        file_unpacked_ = false;
+        player_.start(file, loop);
+    }
+
+    // Must only be called from the render thread, others use stop_file
+    void end_file() {
+        AnimationFile* file = const_cast<AnimationFile*>(player_.get_file());
+        if (!file)
+            return;
+        // animations that come next start from the last frame of the file
+        rgbw_unpack_array(file_frame_, layers_[LAYER_BASE].image_, COUNT);
+        layers_[LAYER_BASE].changed_ = true;
+        player_.stop();
+        retire_file(file);
+    }
+
+    // Returns false if leds didn't change
+    bool render(ws2811_led_t *leds) {
+        render();
+        if (!memcmp(packed_, leds, sizeof(packed_)))
+            return false;
+        memcpy(leds, packed_, sizeof(packed_));
+        published_.publish(leds);
+        return true;
+    }
+
+    // Returns the CLOCK_MONOTONIC time in ns when the LEDs can change next
+    // without a new command, UINT64_MAX if never
+    uint64_t get_next_change() {
+        return next_change_;
     }
 
+    // Takes a snapshot of the LED colors for get_led() and returns its frame number.
+    // The snapshot is shared by all clients.
+    uint32_t capture() {
+        std::lock_guard<std::mutex> lock(capture_mutex_);
+        return published_.read(captured_);
+    }
+
+    // Returns the color of one LED in the last snapshot as 0xWWRRGGBB, before brightness and gamma
+    uint32_t get_led(uint32_t index) {
+        std::lock_guard<std::mutex> lock(capture_mutex_);
+        return index < COUNT ? captured_[index] : 0;
+    }
+
+    // The functions of the strip itself control the base layer
     void set_color(float white, float red, float green, float blue, float duration, bool limit_brightness) {
-        printf("set_color\n");
-        start_fade((rgbw_t){
-            .w = white,
-            .r = red,
-            .g = green,
-            .b = blue
-        }, duration, limit_brightness);
+        layers_[LAYER_BASE].set_color(white, red, green, blue, duration, limit_brightness);
+    }
+
+    bool play_effect(uint32_t effect) {
+        return layers_[LAYER_BASE].play_effect(effect);
+    }
+
+    void add_keyframe(float time, float white, float red, float green, float blue, uint32_t easing, bool limit_brightness) {
+        layers_[LAYER_BASE].add_keyframe(time, white, red, green, blue, easing, limit_brightness);
+    }
+
+    void clear_keyframes() {
+        layers_[LAYER_BASE].clear_keyframes();
+    }
+
+    void play_keyframes(bool loop) {
+        layers_[LAYER_BASE].play_keyframes(loop);
     }
 
+    // Plays the animation file in the given slot of the animation store
+    void play_file(uint32_t slot, bool loop) {
+        AnimationFile* file = animation_store.open(slot);
+        if (!file)
+            return;
+        play_opened_file(file, loop);
+        file->release();
+    }
+
+    // Plays a file that is open already. The strip takes its own reference,
+    // so several strips can play the same file.
+    void play_opened_file(AnimationFile* file, bool loop) {
+        printf("play_file\n");
+        release_retired_files();
+        file->acquire();
+        Command command = { .type = Command::PLAY_FILE, .layer = LAYER_BASE, .file = { .file = file, .loop = loop } };
+        if (!send(command))
+            file->release();
+    }
+
+    // Stops the animation file and keeps showing its current frame
+    void stop_file() {
+        release_retired_files();
+        Command command = { .type = Command::STOP_FILE, .layer = LAYER_BASE };
+        send(command);
+    }
+
+    const uint32_t led_count_ = COUNT;
+    Layer layers_[LAYER_COUNT];
+
     FIBRE_EXPORTS(LEDController,
         //make_fibre_function("start_music", *obj, &LEDController::start_music),
-        make_fibre_function("set_color", *obj, &LEDController::set_color, "white", "red", "green", "blue", "duration", "limit_brightness")
+        make_fibre_function("set_color", *obj, &LEDController::set_color, "white", "red", "green", "blue", "duration", "limit_brightness"),
+        make_fibre_function("add_keyframe", *obj, &LEDController::add_keyframe, "time", "white", "red", "green", "blue", "easing", "limit_brightness"),
+        make_fibre_function("clear_keyframes", *obj, &LEDController::clear_keyframes),
+        make_fibre_function("play_keyframes", *obj, &LEDController::play_keyframes, "loop"),
+        make_fibre_function("play_effect", *obj, &LEDController::play_effect, "effect"),
+        make_fibre_object("effect", layers_[LAYER_BASE].effect_parameters_.make_fibre_definitions()),
+        make_fibre_function("play_file", *obj, &LEDController::play_file, "slot", "loop"),
+        make_fibre_function("stop_file", *obj, &LEDController::stop_file),
+        make_fibre_object("base", layers_[LAYER_BASE].make_fibre_definitions()),
+        make_fibre_object("overlay", layers_[LAYER_OVERLAY].make_fibre_definitions()),
+        make_fibre_object("flash", layers_[LAYER_FLASH].make_fibre_definitions()),
+        make_fibre_ro_property("led_count", &led_count_),
+        make_fibre_function("capture", *obj, &LEDController::capture),
+        make_fibre_function("get_led", *obj, &LEDController::get_led, "index")
     );
 
 private:
+    // Commands from the Fibre threads to the render thread
+    struct Command {
+        enum { FADE, ADD_KEYFRAME, CLEAR_KEYFRAMES, PLAY_KEYFRAMES, START_EFFECT, SET_BLEND, CLEAR_LAYER, PLAY_FILE, STOP_FILE } type;
+        uint8_t layer;
+        union {
+            struct {
+                rgbw_t target;
+                float duration;
+                bool limit_brightness;
+            } fade;
+            Keyframe keyframe;
+            bool loop;
+            Effect effect;
+            struct {
+                float alpha;
+                BlendMode mode;
+            } blend;
+            struct {
+                AnimationFile* file;
+                bool loop;
+            } file;
+        };
+    };
+
+    bool send(const Command& command) {
+        bool ok = commands_.push(command);
+        if (!ok)
+            fprintf(stderr, "command queue full, dropping command\n");
+        scheduler.wake();
+        return ok;
+    }
+
+    // The references to files that the render thread is done with are
+    // released by the Fibre threads, so the render thread doesn't block in munmap
+    void retire_file(AnimationFile* file) {
+        if (!retired_files_.push(file))
+            file->release(); // only if nobody called play_file or stop_file for a while
+    }
+
+    void release_retired_files() {
+        std::lock_guard<std::mutex> lock(retired_files_mutex_);
+        AnimationFile* file;
+        while (retired_files_.pop(&file))
+            file->release();
+    }
+
+    // Stops whatever the layer plays, so a new animation can start from its
+    // current image. Returns false if the start time can't be read.
+    bool start_animation(Layer& layer) {
+        if (clock_gettime(CLOCK_MONOTONIC, &layer.animation_start_)) {
+            fprintf(stderr, "clock failed\n");
+            return false;
+        }
+        if (&layer == &layers_[LAYER_BASE])
+            end_file();
+        layer.animation_.reset();
+        layer.active_ = true;
+        layer.changed_ = true;
+        return true;
+    }
+
+    void process_commands() {
+        Command command;
+        while (commands_.pop(&command)) {
+            Layer& layer = layers_[command.layer];
+            switch (command.type) {
+                case Command::FADE:
+                    start_fade(layer, command.fade.target, command.fade.duration, command.fade.limit_brightness);
+                    break;
+                case Command::ADD_KEYFRAME:
+                    if (layer.num_keyframes_ < MAX_KEYFRAMES)
+                        layer.keyframes_[layer.num_keyframes_++] = command.keyframe;
+                    else
+                        fprintf(stderr, "too many keyframes, dropping keyframe\n");
+                    break;
+                case Command::CLEAR_KEYFRAMES:
+                    layer.num_keyframes_ = 0;
+                    break;
+                case Command::PLAY_KEYFRAMES:
+                    if (layer.num_keyframes_)
+                        start_keyframes(layer, layer.keyframes_, layer.num_keyframes_, command.loop);
+                    layer.num_keyframes_ = 0;
+                    break;
+                case Command::START_EFFECT:
+                    start_effect(layer, command.effect);
+                    break;
+                case Command::SET_BLEND:
+                    // 0 comes first, std::max returns it for NaN
+                    layer.alpha_.store(std::min(std::max(0.f, command.blend.alpha), 1.f), std::memory_order_relaxed);
+                    layer.blend_mode_.store(command.blend.mode, std::memory_order_relaxed);
+                    layer.changed_ = true;
+                    break;
+                case Command::CLEAR_LAYER:
+                    clear_layer(layer);
+                    break;
+                case Command::PLAY_FILE:
+                    start_file(command.file.file, command.file.loop);
+                    break;
+                case Command::STOP_FILE:
+                    end_file();
+                    break;
+            }
+        }
+    }
+
+    // Draws the layer's animation if it has one. Finished animations are
+    // released, the layer keeps their last frame. Returns true if the
+    // layer's image, alpha or blend mode changed since the last frame.
+    bool update_layer(Layer& layer, struct timespec* currenttime) {
+        if (layer.animation_ && layer.is_visible()) {
+            layer.animation_->draw(currenttime, &layer.animation_start_, layer.image_, COUNT);
+            float next_change = layer.animation_->get_time_to_next_change(currenttime, &layer.animation_start_, COUNT);
+            if (next_change < 1e6f) // not INFINITY
+                next_change_ = std::min<uint64_t>(next_change_, currenttime->tv_sec * 1000000000ull + currenttime->tv_nsec +
+                                                                static_cast<uint64_t>(next_change * 1e9f));
+            else
+                layer.animation_.reset();
+            layer.changed_ = true;
+        }
+        bool changed = layer.changed_;
+        layer.changed_ = false;
+        return changed;
+    }
+
+    // Blends the layer onto below. Returns the result, which is either
+    // below, the layer's image or output.
+    const color_t* blend_layer(const color_t* below, Layer& layer, color_t* output) {
+        if (!layer.is_visible())
+            return below;
+        float alpha = layer.alpha();
+        BlendMode blend_mode = layer.blend_mode();
+        if (blend_mode == BLEND_NORMAL && alpha >= 1)
+            return layer.image_;
+        const color_t* above = layer.image_;
+        if (blend_mode != BLEND_NORMAL) {
+            rgbw_combine_array(blend_mode, below, layer.image_, scratch_, COUNT);
+            above = scratch_;
+        }
+        rgbw_blend_array(below, above, alpha, output, COUNT);
+        return output;
+    }
+
     void render() {
+        process_commands();
+
         struct timespec currenttime;
         if (clock_gettime(CLOCK_MONOTONIC, &currenttime)) {
             fprintf(stderr, "clock failed\n");
             return;
         }
 
-        if (animation_)
-            animation_->draw(&currenttime, &animation_start_, img_current_, COUNT);
-    }
+        next_change_ = UINT64_MAX;
+        Layer& base = layers_[LAYER_BASE];
+        if (player_.get_file()) {
+            uint64_t start = base.animation_start_.tv_sec * 1000000000ull + base.animation_start_.tv_nsec;
+            uint64_t now = currenttime.tv_sec * 1000000000ull + currenttime.tv_nsec;
+            bool new_frame;
+            uint64_t next_frame = player_.draw(now - start, file_frame_, COUNT, &new_frame);
+            file_unpacked_ &= !new_frame;
+
+            bool covered = false;
+            for (size_t i = LAYER_BASE + 1; i < LAYER_COUNT; ++i)
+                covered |= layers_[i].is_visible();
+            if (next_frame == UINT64_MAX) {
+                end_file(); // the last frame stays in the base layer
+            } else if (!covered && base.alpha() >= 1 && base.blend_mode() == BLEND_NORMAL) {
+                // nothing to blend, the file goes straight to the LEDs
+                next_change_ = start + next_frame;
+                memcpy(packed_, file_frame_, sizeof(packed_));
+                return;
+            } else {
+                next_change_ = start + next_frame;
+                if (!file_unpacked_) {
+                    // only a new frame changes the base layer, so the blend cache stays valid
+                    rgbw_unpack_array(file_frame_, base.image_, COUNT);
+                    base.changed_ = true;
+                    file_unpacked_ = true;
+                }
+            }
+        }
 
-    static uint8_t to_uint8(float val) {
-        return (val <= 0) ? 0 : (val >= 1) ? 255 : static_cast<uint8_t>(val * 255.f);
+        // everything above the lowest changed layer is blended again
+        bool changed = false;
+        const color_t* below = black_;
+        for (size_t i = 0; i < LAYER_COUNT; ++i) {
+            changed |= update_layer(layers_[i], &currenttime);
+            if (changed)
+                output_[i] = blend_layer(below, layers_[i], blended_[i]);
+            below = output_[i];
+        }
+        if (changed)
+            rgbw_pack_array(below, packed_, COUNT);
     }
 
-    std::shared_ptr<Animation> animation_ = nullptr;
-    struct timespec animation_start_; // time when the animation started
-    rgbw_t img_current_[COUNT]; // 1-D image representing the current LED colors
+    MpscQueue<Command, 32> commands_; // enough for a whole keyframe animation
+    // Animations come from pools, so starting one doesn't allocate. Only the
+    // render thread creates and releases them. One of each kind per layer.
+    ObjectPool<FadeToColorAnimation<COUNT>, LAYER_COUNT> fade_pool_;
+    ObjectPool<KeyframeAnimation<COUNT>, LAYER_COUNT> keyframe_pool_;
+    ObjectPool<EffectAnimation<COUNT>, LAYER_COUNT> effect_pool_;
+    AnimationFilePlayer player_;
+    ws2811_led_t file_frame_[COUNT]; // the current frame of the animation file
+    bool file_unpacked_ = false; // base.image_ holds file_frame_
+    MpscQueue<AnimationFile*, 4> retired_files_; // to the Fibre threads
+    std::mutex retired_files_mutex_; // only between the Fibre threads
+    const color_t black_[COUNT] = {}; // below the base layer
+    color_t blended_[LAYER_COUNT][COUNT]; // each layer blended onto the ones below
+    const color_t* output_[LAYER_COUNT] = {}; // the result of each layer, may point to blended_ or an image
+    color_t scratch_[COUNT];
+    ws2811_led_t packed_[COUNT];
+    uint64_t next_change_ = UINT64_MAX;
+    // The packed colors for readers on other threads
+    PublishedFrame<COUNT> published_;
+    std::mutex capture_mutex_; // only between readers
+    ws2811_led_t captured_[COUNT] = {};
 };
 
 
@@ -204,6 +813,7 @@ private:
 
 LEDController<LEDSTRIP1_LENGTH> controller1;
 LEDController<LEDSTRIP2_LENGTH> controller2;
+Stats stats;
 
 
 
@@ -214,10 +824,47 @@ public:
         controller1.set_color(white, red, green, blue, duration, limit_brightness);
         controller2.set_color(white, red, green, blue, duration, limit_brightness);
     }
+    void add_keyframe(float time, float white, float red, float green, float blue, uint32_t easing, bool limit_brightness) {
+        controller1.add_keyframe(time, white, red, green, blue, easing, limit_brightness);
+        controller2.add_keyframe(time, white, red, green, blue, easing, limit_brightness);
+    }
+    void clear_keyframes() {
+        controller1.clear_keyframes();
+        controller2.clear_keyframes();
+    }
+    void play_keyframes(bool loop) {
+        controller1.play_keyframes(loop);
+        controller2.play_keyframes(loop);
+    }
+    bool play_effect(uint32_t effect) {
+        bool ok = controller1.play_effect(effect);
+        return controller2.play_effect(effect) && ok;
+    }
+    // Both strips play the same mapping of the file
+    void play_file(uint32_t slot, bool loop) {
+        AnimationFile* file = animation_store.open(slot);
+        if (!file)
+            return;
+        controller1.play_opened_file(file, loop);
+        controller2.play_opened_file(file, loop);
+        file->release();
+    }
+    void stop_file() {
+        controller1.stop_file();
+        controller2.stop_file();
+    }
     FIBRE_EXPORTS(RootObject,
         make_fibre_function("set_color", *obj, &RootObject::set_color, "white", "red", "green", "blue", "duration", "limit_brightness"),
+        make_fibre_function("add_keyframe", *obj, &RootObject::add_keyframe, "time", "white", "red", "green", "blue", "easing", "limit_brightness"),
+        make_fibre_function("clear_keyframes", *obj, &RootObject::clear_keyframes),
+        make_fibre_function("play_keyframes", *obj, &RootObject::play_keyframes, "loop"),
+        make_fibre_function("play_effect", *obj, &RootObject::play_effect, "effect"),
+        make_fibre_function("play_file", *obj, &RootObject::play_file, "slot", "loop"),
+        make_fibre_function("stop_file", *obj, &RootObject::stop_file),
+        make_fibre_object("animations", animation_store.make_fibre_definitions()),
         make_fibre_object("ledstrip1", controller1.make_fibre_definitions()),
-        make_fibre_object("ledstrip2", controller2.make_fibre_definitions())
+        make_fibre_object("ledstrip2", controller2.make_fibre_definitions()),
+        make_fibre_object("stats", stats.make_fibre_definitions())
     );
 };
 
@@ -225,16 +872,167 @@ RootObject root_object;
 
 
 
-static int running = 1;
+static std::atomic<int> running{1};
 static void sigterm_handler(int signum) {
 	(void)(signum);
     running = 0;
 }
 
-int main() {
+// Real-time mode (--realtime CPU): the render loop runs on its own thread
+// with SCHED_FIFO priority, pinned to CPU. All other threads, including the
+// Fibre servers and the threads they start for each client, stay off that
+// CPU. All memory is locked, so rendering never waits for a page fault.
+constexpr int REALTIME_PRIORITY = 50; // above normal threads, below the kernel's IRQ threads
+constexpr size_t REALTIME_STACK_SIZE = 256 * 1024;
+
+// Needs to run before any other thread is started
+static bool realtime_setup_process(int cpu) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpu < 0 || cpu >= cpus || cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "CPU %d doesn't exist\n", cpu);
+        return false;
+    }
+
+    // threads inherit the CPU affinity of the thread that starts them
+    cpu_set_t others;
+    CPU_ZERO(&others);
+    for (long i = 0; i < cpus && i < CPU_SETSIZE; ++i)
+        if (i != cpu)
+            CPU_SET(i, &others);
+    if (cpus < 2)
+        fprintf(stderr, "only one CPU, can't move the other threads away from the render thread\n");
+    else if (sched_setaffinity(0, sizeof(others), &others))
+        perror("sched_setaffinity");
+
+    // Locked memory includes all thread stacks, so keep them small. The
+    // threads we start don't need much.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REALTIME_STACK_SIZE);
+    pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        perror("mlockall");
+        return false;
+    }
+    return true;
+}
+
+static ws2811_return_t render_loop(FrameScheduler& scheduler) {
+    ws2811_return_t ret = WS2811_SUCCESS;
+
+    scheduler.start();
+    uint64_t stats_update = scheduler.now();
+    bool changed = true; // the first frame clears whatever the strip showed before
+    while (running) {
+        // let the LED controllers render the LEDs
+        uint64_t frame_start = scheduler.now();
+        changed |= controller1.render(ledstrip.channel[0].leds);
+        changed |= controller2.render(ledstrip.channel[1].leds);
+        stats.animation.record((scheduler.now() - frame_start) / 1000);
+        
+        // let the driver output the colors while we prepare the next frame,
+        // unless the strip already shows them
+        if (changed) {
+            if ((ret = ws2811_render_async(&ledstrip)) != WS2811_SUCCESS) {
+                fprintf(stderr, "ws2811_render_async failed: %s\n", ws2811_get_return_t_str(ret));
+                break;
+            }
+            stats.encode.record(ledstrip.encode_time_us);
+            stats.dma_wait.record(ledstrip.wait_time_us);
+            changed = false;
+        }
+
+        // If no LED changes before the next deadline, sleep until one does or
+        // until a command comes in. Wake up at least once per second to
+        // refresh the stats.
+        uint64_t next_change = std::min(controller1.get_next_change(), controller2.get_next_change());
+        uint64_t sleep_start = scheduler.now();
+        if (next_change > scheduler.get_next_deadline())
+            scheduler.idle_until(std::min<uint64_t>(next_change, sleep_start + 1000000000ull));
+        else
+            scheduler.wait_for_next_frame();
+        uint64_t frame_end = scheduler.now();
+        stats.sleep.record((frame_end - sleep_start) / 1000);
+
+        // refresh the Fibre properties once per second
+        if (frame_end - stats_update >= 1000000000ull) {
+            stats.update(frame_end, scheduler.get_frames(), scheduler.get_skipped_frames(), scheduler.get_overruns());
+            stats_update = frame_end;
+        }
+    }
+
+    return ret;
+}
+
+struct RealtimeRenderThread {
+    FrameScheduler* scheduler;
+    ws2811_return_t ret;
+};
+
+static void* realtime_render_thread(void* arg) {
+    RealtimeRenderThread* thread = static_cast<RealtimeRenderThread*>(arg);
+    thread->ret = render_loop(*thread->scheduler);
+    return nullptr;
+}
+
+// Runs the render loop on a SCHED_FIFO thread pinned to cpu and waits for it to end
+static ws2811_return_t realtime_render_loop(FrameScheduler& scheduler, int cpu) {
+    RealtimeRenderThread thread = { .scheduler = &scheduler, .ret = WS2811_SUCCESS };
+    pthread_t handle;
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = REALTIME_PRIORITY };
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    int err = pthread_create(&handle, &attr, realtime_render_thread, &thread);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        fprintf(stderr, "failed to start real-time render thread: %s\n", strerror(err));
+        return WS2811_ERROR_GENERIC;
+    }
+
+    pthread_join(handle, nullptr);
+    return thread.ret;
+}
+
+int main(int argc, char *argv[]) {
     ws2811_return_t ret = WS2811_SUCCESS;
     printf("Starting LED server...\n");
 
+    // --mock runs without LED hardware, e.g. on a PC
+    // --fps N sets the target frame rate
+    // --realtime CPU renders on a real-time thread on the given CPU
+    // --animations DIR is where the animation files are stored
+    ws2811_mock_t mock;
+    int realtime_cpu = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--mock")) {
+            ws2811_mock_init(&mock);
+            ledstrip.backend = &mock.backend;
+            printf("Using mock LED driver.\n");
+        } else if (!strcmp(argv[i], "--fps") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            scheduler.set_fps(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--realtime") && i + 1 < argc) {
+            realtime_cpu = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--animations") && i + 1 < argc) {
+            animation_store.set_directory(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--mock] [--fps N] [--realtime CPU] [--animations DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (realtime_cpu >= 0 && !realtime_setup_process(realtime_cpu))
+        return 1;
+
     // set up terminate-signals
     struct sigaction sa;
     sa.sa_handler = sigterm_handler;
@@ -254,22 +1052,19 @@ int main() {
     // Expose Fibre objects on TCP and UDP
     std::thread server_thread_tcp(serve_on_tcp, 9910);
     std::thread server_thread_udp(serve_on_udp, 9910);
+    // the servers never return, so don't try to join them on exit
+    server_thread_tcp.detach();
+    server_thread_udp.detach();
     printf("LED server started.\n");
 
-    while (running) {
-        // let the LED controllers render the LEDs
-        controller1.render(ledstrip.channel[0].leds);
-        controller2.render(ledstrip.channel[1].leds);
-        
-        // let the driver output the colors
-        if ((ret = ws2811_render(&ledstrip)) != WS2811_SUCCESS) {
-            fprintf(stderr, "ws2811_render failed: %s\n", ws2811_get_return_t_str(ret));
-            break;
-        }
+    if (realtime_cpu >= 0)
+        ret = realtime_render_loop(scheduler, realtime_cpu);
+    else
+        ret = render_loop(scheduler);
 
-        // 100 frames / sec
-        usleep(1000000 / 100);
-    }
+    printf("%.1f fps (target %u), %llu overruns, %llu frames skipped\n",
+           scheduler.get_achieved_fps(), scheduler.get_fps(),
+           (unsigned long long)scheduler.get_overruns(), (unsigned long long)scheduler.get_skipped_frames());
 
     ws2811_fini(&ledstrip);
 
@@ -0,0 +1,71 @@
+#ifndef __OBJECT_POOL_HPP
+#define __OBJECT_POOL_HPP
+
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Returns an object to the pool it came from. This lets one
+// std::unique_ptr<TBase, PoolDeleter<TBase>> hold objects of different types
+// from different pools.
+template<typename TBase>
+struct PoolDeleter {
+    void (*release)(void* pool, TBase* obj);
+    void* pool;
+
+    void operator()(TBase* obj) const {
+        release(pool, obj);
+    }
+};
+
+template<typename TBase>
+using PoolPtr = std::unique_ptr<TBase, PoolDeleter<TBase>>;
+
+// Storage for up to N objects of type T, so they can be created and destroyed
+// without touching the heap. Not thread safe, all objects must be created and
+// released on the same thread.
+template<typename T, size_t N>
+class ObjectPool {
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    // Returns nullptr if all slots are in use
+    template<typename TBase = T, typename ... TArgs>
+    PoolPtr<TBase> create(TArgs&& ... args) {
+        for (size_t i = 0; i < N; ++i) {
+            if (!used_[i]) {
+                T* obj = new (&slots_[i]) T(std::forward<TArgs>(args)...);
+                used_[i] = true;
+                return PoolPtr<TBase>(obj, PoolDeleter<TBase>{ &ObjectPool::release<TBase>, this });
+            }
+        }
+        return PoolPtr<TBase>(nullptr, PoolDeleter<TBase>{ &ObjectPool::release<TBase>, this });
+    }
+
+    size_t available() const {
+        size_t count = 0;
+        for (size_t i = 0; i < N; ++i)
+            count += !used_[i];
+        return count;
+    }
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    template<typename TBase>
+    static void release(void* pool, TBase* obj) {
+        ObjectPool* self = static_cast<ObjectPool*>(pool);
+        T* derived = static_cast<T*>(obj);
+        derived->~T();
+        self->used_[reinterpret_cast<Slot*>(derived) - self->slots_] = false;
+    }
+
+    Slot slots_[N];
+    bool used_[N] = {};
+};
+
+#endif // __OBJECT_POOL_HPP
@@ -0,0 +1,46 @@
+#ifndef __PUBLISHED_FRAME_HPP
+#define __PUBLISHED_FRAME_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#include "rpi_ws281x/ws2811.h"
+
+// The last frame of the render thread, readable from any other thread.
+// Protected by a seqlock: the sequence number is odd while the render thread
+// writes, and readers retry if it was odd or changed while they copied. The
+// render thread never waits, readers only wait while a frame is written.
+template<size_t COUNT>
+class PublishedFrame {
+public:
+    // Must only be called from the render thread
+    void publish(const ws2811_led_t* leds) {
+        uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < COUNT; ++i)
+            leds_[i].store(leds[i], std::memory_order_relaxed);
+        sequence_.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Copies the whole frame without tearing and returns its frame number
+    uint32_t read(ws2811_led_t* leds) const {
+        for (;;) {
+            uint32_t sequence = sequence_.load(std::memory_order_acquire);
+            if (sequence & 1)
+                continue;
+            for (size_t i = 0; i < COUNT; ++i)
+                leds[i] = leds_[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence_.load(std::memory_order_relaxed) == sequence)
+                return sequence / 2;
+        }
+    }
+
+private:
+    std::atomic<uint32_t> sequence_{0};
+    std::atomic<ws2811_led_t> leds_[COUNT] = {};
+};
+
+#endif // __PUBLISHED_FRAME_HPP
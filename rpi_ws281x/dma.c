@@ -28,6 +28,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -38,6 +40,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "mailbox.h"
 #include "dma.h"
 
 
@@ -76,3 +79,215 @@ uint32_t dmanum_to_offset(int dmanum)
 }
 
 
+/**
+ * Given a userspace address pointer, return the matching bus address used by DMA.
+ *     Note: The bus address is not the same as the CPU physical address.
+ *
+ * @param    mem    DMA memory the address points into.
+ * @param    virt   Userspace virtual address pointer.
+ *
+ * @returns  Bus address for use by DMA, 0 if virt isn't in mem.
+ */
+uint32_t dma_mem_bus_addr(const dma_mem_t *mem, const volatile void *virt)
+{
+    int i;
+
+    for (i = 0; i < mem->segment_count; i++)
+    {
+        const videocore_mbox_t *mbox = &mem->segments[i];
+        uintptr_t offset = (const uint8_t *)virt - mbox->virt_addr;
+
+        if (offset < mbox->size)
+        {
+            return mbox->bus_addr + offset;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate the DMA memory for byte_count bytes per buffer in segments of at
+ * most DMA_SEGMENT_SIZE and map them into one reserved virtual range, so
+ * that no single large physically contiguous allocation is needed.  Sets up
+ * the cb and buf pointers.  Partial allocations are released by
+ * dma_mem_free().
+ *
+ * @param    mem         Zeroed DMA memory instance.
+ * @param    ops         GPU memory operations.
+ * @param    handle      Mailbox from ops->open().
+ * @param    mem_flags   Flags for ops->mem_alloc(), they depend on the Pi model.
+ * @param    byte_count  Size of each DMA buffer in bytes.
+ *
+ * @returns  0 on success, < 0 on error.
+ */
+ws2811_return_t dma_mem_alloc(dma_mem_t *mem, const struct mbox_ops *ops, int handle,
+                              uint32_t mem_flags, uint32_t byte_count)
+{
+    uint32_t cb_count = (byte_count + DMA_SEGMENT_SIZE - 1) / DMA_SEGMENT_SIZE;
+    uint32_t cb_size = PAGE_ROUND_UP(WS2811_BUFFER_COUNT * cb_count * sizeof(dma_cb_t));
+    uint32_t buf_size = PAGE_ROUND_UP(byte_count);
+    uint32_t region_size[1 + WS2811_BUFFER_COUNT];
+    uint32_t offset = 0;
+    int max_segments, region, buf;
+    void *virt;
+
+    mem->ops = ops;
+    mem->handle = handle;
+
+    region_size[0] = cb_size;
+    for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+    {
+        region_size[1 + buf] = buf_size;
+    }
+
+    max_segments = (cb_size + DMA_SEGMENT_SIZE - 1) / DMA_SEGMENT_SIZE +
+                   WS2811_BUFFER_COUNT * cb_count;
+    mem->segments = calloc(max_segments, sizeof(videocore_mbox_t));
+    if (!mem->segments)
+    {
+        return WS2811_ERROR_OUT_OF_MEMORY;
+    }
+
+    virt = mmap(NULL, cb_size + WS2811_BUFFER_COUNT * buf_size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (virt == MAP_FAILED)
+    {
+        return WS2811_ERROR_MMAP;
+    }
+    mem->virt_addr = virt;
+    mem->size = cb_size + WS2811_BUFFER_COUNT * buf_size;
+
+    // Segments never cross a region, so each buffer starts at a segment and
+    // control blocks don't straddle two segments
+    for (region = 0; region < 1 + WS2811_BUFFER_COUNT; region++)
+    {
+        uint32_t region_end = offset + region_size[region];
+
+        while (offset < region_end)
+        {
+            videocore_mbox_t *mbox = &mem->segments[mem->segment_count];
+
+            mbox->handle = handle;
+            mbox->size = region_end - offset;
+            if (mbox->size > DMA_SEGMENT_SIZE)
+            {
+                mbox->size = DMA_SEGMENT_SIZE;
+            }
+
+            mbox->mem_ref = ops->mem_alloc(mbox->handle, mbox->size, PAGE_SIZE, mem_flags);
+            if (mbox->mem_ref == 0)
+            {
+                return WS2811_ERROR_OUT_OF_MEMORY;
+            }
+
+            mbox->bus_addr = ops->mem_lock(mbox->handle, mbox->mem_ref);
+            if (mbox->bus_addr == (uint32_t) ~0UL)
+            {
+                ops->mem_free(mbox->handle, mbox->mem_ref);
+                return WS2811_ERROR_MEM_LOCK;
+            }
+
+            // From here on the segment is released by dma_mem_free()
+            mem->segment_count++;
+
+            mbox->virt_addr = mem->virt_addr + offset;
+            if (!ops->map_fixed(mbox->virt_addr, BUS_TO_PHYS(mbox->bus_addr), mbox->size))
+            {
+                return WS2811_ERROR_MMAP;
+            }
+
+            offset += mbox->size;
+        }
+    }
+
+    mem->cb_count = cb_count;
+    for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+    {
+        mem->cb[buf] = (dma_cb_t *)mem->virt_addr + buf * cb_count;
+        mem->buf[buf] = mem->virt_addr + cb_size + buf * buf_size;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Unmap and release the DMA memory, also after dma_mem_alloc() failed part
+ * way.  The mailbox itself stays open.
+ *
+ * @param    mem  DMA memory instance.
+ *
+ * @returns  None
+ */
+void dma_mem_free(dma_mem_t *mem)
+{
+    int i, buf;
+
+    if (mem->virt_addr)
+    {
+        munmap(mem->virt_addr, mem->size);
+        mem->virt_addr = NULL;
+    }
+
+    if (mem->segments)
+    {
+        for (i = 0; i < mem->segment_count; i++)
+        {
+            videocore_mbox_t *mbox = &mem->segments[i];
+
+            mem->ops->mem_unlock(mbox->handle, mbox->mem_ref);
+            mem->ops->mem_free(mbox->handle, mbox->mem_ref);
+        }
+        free(mem->segments);
+        mem->segments = NULL;
+        mem->segment_count = 0;
+    }
+
+    mem->cb_count = 0;
+    for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+    {
+        mem->cb[buf] = NULL;
+        mem->buf[buf] = NULL;
+    }
+}
+
+/**
+ * Build the control block chain of each buffer, one control block per
+ * segment of the buffer, each linked to the next one.
+ *
+ * @param    mem         DMA memory from dma_mem_alloc().
+ * @param    byte_count  Number of bytes to transfer per buffer.
+ * @param    ti          Transfer information for all control blocks.
+ * @param    dest_ad     Bus address of the peripheral FIFO.
+ *
+ * @returns  None
+ */
+void dma_chain_init(dma_mem_t *mem, uint32_t byte_count, uint32_t ti, uint32_t dest_ad)
+{
+    int buf, i;
+
+    for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+    {
+        volatile dma_cb_t *dma_cb = mem->cb[buf];
+
+        for (i = 0; i < mem->cb_count; i++)
+        {
+            uint32_t offset = i * DMA_SEGMENT_SIZE;
+            uint32_t len = byte_count - offset;
+
+            if (len > DMA_SEGMENT_SIZE)
+            {
+                len = DMA_SEGMENT_SIZE;
+            }
+
+            dma_cb[i].ti = ti;
+            dma_cb[i].source_ad = dma_mem_bus_addr(mem, mem->buf[buf] + offset);
+            dma_cb[i].dest_ad = dest_ad;
+            dma_cb[i].txfr_len = len;
+            dma_cb[i].stride = 0;
+            dma_cb[i].nextconbk = (i + 1 < mem->cb_count) ?
+                                  dma_mem_bus_addr(mem, &dma_cb[i + 1]) : 0;
+        }
+    }
+}
+
@@ -30,6 +30,8 @@
 #ifndef __DMA_H__
 #define __DMA_H__
 
+#include "ws2811.h"
+
 
 /*
  * DMA Control Block in Main Memory
@@ -123,4 +125,53 @@ typedef struct
 
 uint32_t dmanum_to_offset(int dmanum);
 
+
+#define BUS_TO_PHYS(x)                           ((x)&~0xC0000000)
+
+#define PAGE_ROUND_UP(x)                         (((x) + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1))
+
+// DMA memory is allocated in chunks of at most this size, each one fed to the
+// DMA engine by its own control block.  Stays below the 64KiB transfer length
+// limit of the DMA lite channels.
+#define DMA_SEGMENT_SIZE                         (15 * PAGE_SIZE)
+
+// We use the mailbox interface to request memory from the VideoCore.
+// This lets us request physically contiguous chunks, find their
+// physical address, and map them 'uncached' so that writes from this
+// code are immediately visible to the DMA controller.  This struct
+// holds data relevant to one such chunk.
+typedef struct videocore_mbox {
+    int handle;             /* From mbox_open() */
+    unsigned mem_ref;       /* From mem_alloc() */
+    unsigned bus_addr;      /* From mem_lock() */
+    unsigned size;          /* Size of allocation */
+    uint8_t *virt_addr;     /* Where the chunk is mapped */
+} videocore_mbox_t;
+
+/*
+ * DMA memory made of physically contiguous segments, mapped back to back so
+ * that the CPU sees one contiguous range: the control blocks, then each of
+ * the buffers.  A buffer is fed to the DMA engine by a chain of control
+ * blocks, one per segment.  Only needs the mailbox, not the peripheral
+ * registers.
+ */
+typedef struct
+{
+    const struct mbox_ops *ops;
+    int handle;                                   // from ops->open()
+    uint8_t *virt_addr;                           // reserved virtual range
+    uint32_t size;
+    videocore_mbox_t *segments;
+    int segment_count;
+    int cb_count;                                 // control blocks per buffer
+    volatile dma_cb_t *cb[WS2811_BUFFER_COUNT];   // control block chain of each buffer
+    volatile uint8_t *buf[WS2811_BUFFER_COUNT];
+} dma_mem_t;
+
+ws2811_return_t dma_mem_alloc(dma_mem_t *mem, const struct mbox_ops *ops, int handle,
+                              uint32_t mem_flags, uint32_t byte_count);
+void dma_mem_free(dma_mem_t *mem);
+uint32_t dma_mem_bus_addr(const dma_mem_t *mem, const volatile void *virt);
+void dma_chain_init(dma_mem_t *mem, uint32_t byte_count, uint32_t ti, uint32_t dest_ad);
+
 #endif /* __DMA_H__ */
@@ -66,6 +66,27 @@ void *mapmem(uint32_t base, uint32_t size, const char *mem_dev) {
     return (char *)mem + (base & offsetmask);
 }
 
+void *mapmem_fixed(void *addr, uint32_t base, uint32_t size, const char *mem_dev) {
+    int mem_fd;
+    void *mem;
+
+    mem_fd = open(mem_dev, O_RDWR | O_SYNC);
+    if (mem_fd < 0) {
+       perror("Can't open /dev/mem");
+       return NULL;
+    }
+
+    // addr and base must be page aligned, the existing mapping at addr is replaced
+    mem = mmap(addr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, mem_fd, base);
+    close(mem_fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap error\n");
+        return NULL;
+    }
+
+    return mem;
+}
+
 void *unmapmem(void *addr, uint32_t size) {
     uint32_t pagemask = ~0UL ^ (getpagesize() - 1);
     uint32_t baseaddr = (uint32_t)addr & pagemask;
@@ -290,3 +311,17 @@ int mbox_open(void) {
 void mbox_close(int file_desc) {
     close(file_desc);
 }
+
+static void *videocore_map_fixed(void *addr, uint32_t base, uint32_t size) {
+    return mapmem_fixed(addr, base, size, DEV_MEM);
+}
+
+const mbox_ops_t mbox_ops_videocore = {
+    .open = mbox_open,
+    .close = mbox_close,
+    .mem_alloc = mem_alloc,
+    .mem_free = mem_free,
+    .mem_lock = mem_lock,
+    .mem_unlock = mem_unlock,
+    .map_fixed = videocore_map_fixed,
+};
@@ -42,8 +42,25 @@ unsigned mem_free(int file_desc, unsigned handle);
 unsigned mem_lock(int file_desc, unsigned handle);
 unsigned mem_unlock(int file_desc, unsigned handle);
 void *mapmem(unsigned base, unsigned size, const char *mem_dev);
+void *mapmem_fixed(void *addr, unsigned base, unsigned size, const char *mem_dev);
 void *unmapmem(void *addr, unsigned size);
 
 unsigned execute_code(int file_desc, unsigned code, unsigned r0, unsigned r1, unsigned r2, unsigned r3, unsigned r4, unsigned r5);
 unsigned execute_qpu(int file_desc, unsigned num_qpus, unsigned control, unsigned noflush, unsigned timeout);
 unsigned qpu_enable(int file_desc, unsigned enable);
+
+// GPU memory operations behind the DMA memory of the LED driver, see
+// dma_mem_alloc().  A fake that doesn't need a VideoCore can stand in for
+// them, as in ws2811_dma_test.  map_fixed maps the physical address base at
+// the page aligned virtual address addr.
+typedef struct mbox_ops {
+    int (*open)(void);
+    void (*close)(int file_desc);
+    unsigned (*mem_alloc)(int file_desc, unsigned size, unsigned align, unsigned flags);
+    unsigned (*mem_free)(int file_desc, unsigned handle);
+    unsigned (*mem_lock)(int file_desc, unsigned handle);
+    unsigned (*mem_unlock)(int file_desc, unsigned handle);
+    void *(*map_fixed)(void *addr, unsigned base, unsigned size);
+} mbox_ops_t;
+
+extern const mbox_ops_t mbox_ops_videocore;
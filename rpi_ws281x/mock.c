@@ -0,0 +1,214 @@
+/*
+ * mock.c
+ *
+ * ws2811 backend without hardware, see mock.h.
+ *
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ws2811.h"
+#include "mock.h"
+
+
+// Pretend to be a Pi 3 unless told otherwise
+static const rpi_hw_t mock_rpi_hw = {
+    .type = RPI_HWVER_TYPE_PI2,
+    .hwver = 0xa02082,
+    .periph_base = 0x3f000000,
+    .videocore_base = 0xc0000000,
+    .desc = "Pi 3 (mock)",
+};
+
+/**
+ * Read one symbol of a channel from the transmit buffer.
+ *
+ * @param    mock     Mock instance pointer.
+ * @param    buf      Transmit buffer.
+ * @param    chan     Channel number.
+ * @param    symbol   Index of the symbol within the channel's bitstream.
+ *
+ * @returns  Symbol value, 0 or 1.
+ */
+static int mock_symbol(ws2811_mock_t *mock, const volatile uint8_t *buf, int chan, uint32_t symbol)
+{
+    const volatile uint32_t *words = (const volatile uint32_t *)buf;
+
+    switch (mock->mode) {
+    case WS2811_MODE_PWM:
+        // The channels take turns word by word, MSB first
+        return (words[(symbol / 32) * RPI_PWM_CHANNELS + chan] >> (31 - symbol % 32)) & 1;
+
+    case WS2811_MODE_PCM:
+        return (words[symbol / 32] >> (31 - symbol % 32)) & 1;
+
+    default:
+        // SPI sends bytes MSB first
+        return (buf[symbol / 8] >> (7 - symbol % 8)) & 1;
+    }
+}
+
+/**
+ * Decode the LED colors of all channels from a transmit buffer.
+ *
+ * @param    mock    Mock instance pointer.
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    buf     Transmit buffer that is being sent.
+ *
+ * @returns  None
+ */
+static void mock_decode(ws2811_mock_t *mock, ws2811_t *ws2811, const volatile uint8_t *buf)
+{
+    int chan, i, j, k;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        const uint8_t shift[] = { channel->rshift, channel->gshift, channel->bshift, channel->wshift };
+        int array_size = (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+        // PWM inverts in hardware, PCM and SPI send inverted symbols
+        int inv = (mock->mode != WS2811_MODE_PWM) && channel->invert;
+        uint32_t symbol = 0;
+
+        for (i = 0; i < channel->count; i++)
+        {
+            ws2811_led_t led = 0;
+
+            for (j = 0; j < array_size; j++)
+            {
+                uint32_t value = 0;
+
+                for (k = 0; k < 8; k++)
+                {
+                    int s0 = mock_symbol(mock, buf, chan, symbol++) ^ inv;
+                    int s1 = mock_symbol(mock, buf, chan, symbol++) ^ inv;
+                    int s2 = mock_symbol(mock, buf, chan, symbol++) ^ inv;
+
+                    // 1 1 0 is a one, 1 0 0 a zero
+                    if (!s0 || s2)
+                    {
+                        mock->decode_errors++;
+                    }
+                    value = (value << 1) | s1;
+                }
+
+                led |= value << shift[j];
+            }
+
+            mock->decoded[chan][i] = led;
+        }
+    }
+}
+
+static const rpi_hw_t *mock_detect(ws2811_backend_t *backend)
+{
+    ws2811_mock_t *mock = (ws2811_mock_t *)backend;
+
+    return mock->rpi_hw ? mock->rpi_hw : &mock_rpi_hw;
+}
+
+static ws2811_return_t mock_init(ws2811_backend_t *backend, ws2811_t *ws2811, int mode,
+                                 uint32_t byte_count, volatile uint8_t *pxl_raw[WS2811_BUFFER_COUNT])
+{
+    ws2811_mock_t *mock = (ws2811_mock_t *)backend;
+    int buf, chan;
+
+    mock->mode = mode;
+    mock->byte_count = byte_count;
+    mock->pxl_raw = pxl_raw;
+
+    for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+    {
+        pxl_raw[buf] = calloc(1, byte_count);
+        if (!pxl_raw[buf])
+        {
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        mock->decoded[chan] = calloc(ws2811->channel[chan].count + 1, sizeof(ws2811_led_t));
+        if (!mock->decoded[chan])
+        {
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+static ws2811_return_t mock_start(ws2811_backend_t *backend, ws2811_t *ws2811, int buffer,
+                                  uint64_t *duration_us)
+{
+    ws2811_mock_t *mock = (ws2811_mock_t *)backend;
+    // The PWM channels share the buffer
+    uint64_t bits = (uint64_t)mock->byte_count * 8 /
+                    (mock->mode == WS2811_MODE_PWM ? RPI_PWM_CHANNELS : 1);
+
+    mock->transfers++;
+
+    if (mock->decode)
+    {
+        mock_decode(mock, ws2811, mock->pxl_raw[buffer]);
+    }
+
+    // 3 symbols per bit
+    *duration_us = mock->instant ? 0 : bits * 1000000 / (3 * ws2811->freq);
+
+    return WS2811_SUCCESS;
+}
+
+static ws2811_return_t mock_wait(ws2811_backend_t *backend, ws2811_t *ws2811)
+{
+    (void)backend;
+    (void)ws2811;
+
+    return WS2811_SUCCESS;
+}
+
+static void mock_fini(ws2811_backend_t *backend, ws2811_t *ws2811)
+{
+    ws2811_mock_t *mock = (ws2811_mock_t *)backend;
+    int buf, chan;
+
+    (void)ws2811;
+
+    if (mock->pxl_raw)
+    {
+        for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+        {
+            free((uint8_t *)mock->pxl_raw[buf]);
+            mock->pxl_raw[buf] = NULL;
+        }
+        mock->pxl_raw = NULL;
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        free(mock->decoded[chan]);
+        mock->decoded[chan] = NULL;
+    }
+}
+
+/**
+ * Set up a mock backend with all options turned off.  Pass &mock->backend as
+ * the backend of a ws2811_t before calling ws2811_init().
+ *
+ * @param    mock  Mock instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_mock_init(ws2811_mock_t *mock)
+{
+    memset(mock, 0, sizeof(*mock));
+
+    mock->backend.detect = mock_detect;
+    mock->backend.init = mock_init;
+    mock->backend.start = mock_start;
+    mock->backend.wait = mock_wait;
+    mock->backend.fini = mock_fini;
+}
@@ -0,0 +1,51 @@
+/*
+ * mock.h
+ *
+ * ws2811 backend that needs no Raspberry Pi peripherals.  The transmit
+ * buffers live in normal memory and a transfer "completes" after the time
+ * the real hardware would take to send it.  Optionally every transfer is
+ * decoded from the PWM, PCM or SPI bitstream back into LED colors.
+ *
+ * Usage:
+ *
+ *     ws2811_mock_t mock;
+ *     ws2811_mock_init(&mock);
+ *     ledstring.backend = &mock.backend;
+ *     ws2811_init(&ledstring);
+ *
+ */
+
+
+#ifndef __MOCK_H__
+#define __MOCK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ws2811.h"
+
+
+typedef struct
+{
+    ws2811_backend_t backend;                    //< Must be the first member
+    int instant;                                 //< Complete transfers right away instead of after the wire time
+    int decode;                                  //< Decode every transfer into decoded
+    ws2811_led_t *decoded[RPI_PWM_CHANNELS];     //< Colors sent by the last transfer, after brightness and gamma
+    unsigned transfers;                          //< Number of transfers started
+    unsigned decode_errors;                      //< Malformed symbols found while decoding
+    const rpi_hw_t *rpi_hw;                      //< Pi to pretend to be, a Pi 3 if NULL
+
+    // Private data
+    int mode;
+    uint32_t byte_count;
+    volatile uint8_t **pxl_raw;
+} ws2811_mock_t;
+
+void ws2811_mock_init(ws2811_mock_t *mock);                            //< Set up a mock backend, all options off
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MOCK_H__ */
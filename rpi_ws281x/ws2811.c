@@ -28,6 +28,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,6 +43,12 @@
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <arpa/inet.h>
 
 #include "mailbox.h"
 #include "clk.h"
@@ -53,8 +61,6 @@
 #include "ws2811.h"
 
 
-#define BUS_TO_PHYS(x)                           ((x)&~0xC0000000)
-
 #define OSC_FREQ                                 19200000   // crystal frequency
 
 /* 4 colors (R, G, B + W), 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
@@ -79,39 +85,86 @@
 #define SYMBOL_HIGH_INV                          0x1  // 0 0 1
 #define SYMBOL_LOW_INV                           0x3  // 0 1 1
 
+// Each color byte expands to 8 bits * 3 symbols on the wire
+#define SYMBOL_BITS_PER_BYTE                     24
+
+// Ping-pong DMA buffers, the CPU fills one while the DMA engine reads the other
+#define DMA_BUFFERS                              WS2811_BUFFER_COUNT
+
 // Driver mode definitions
 #define NONE	0
-#define PWM	1
-#define PCM	2
-#define SPI	3
-
-// We use the mailbox interface to request memory from the VideoCore.
-// This lets us request one physically contiguous chunk, find its
-// physical address, and map it 'uncached' so that writes from this
-// code are immediately visible to the DMA controller.  This struct
-// holds data relevant to the mailbox interface.
-typedef struct videocore_mbox {
-    int handle;             /* From mbox_open() */
-    unsigned mem_ref;       /* From mem_alloc() */
-    unsigned bus_addr;      /* From mem_lock() */
-    unsigned size;          /* Size of allocation */
-    uint8_t *virt_addr;     /* From mapmem() */
-} videocore_mbox_t;
+#define PWM	WS2811_MODE_PWM
+#define PCM	WS2811_MODE_PCM
+#define SPI	WS2811_MODE_SPI
+
+// Half-open range [first, last) of 32-bit words, empty if first >= last
+typedef struct word_range {
+    int first;
+    int last;
+} word_range_t;
+
+// Encodes count LEDs into the word stream at wordptr, returns the end of what was written
+typedef uint32_t *(*encode_leds_fn)(const uint32_t *symbols, const ws2811_led_t *leds,
+                                    int count, uint32_t *wordptr, int strip_type);
+
+// Worker thread that encodes one channel in parallel to the caller of ws2811_render
+typedef struct encode_worker
+{
+    ws2811_t *ws2811;
+    int chan;
+    int encoded;                              // result of the last encode_channel()
+    sem_t start;                              // posted by ws2811_render for every frame
+    pthread_t thread;
+} encode_worker_t;
 
 typedef struct ws2811_device
 {
+    ws2811_backend_t *backend;
     int driver_mode;
-    volatile uint8_t *pxl_raw;
+    int hw_running;                           // peripherals are set up and need to be stopped
+    volatile uint8_t *pxl_raw[DMA_BUFFERS];   // DMA buffers, or SPI transmit buffers
     volatile dma_t *dma;
     volatile pwm_t *pwm;
     volatile pcm_t *pcm;
     int spi_fd;
-    volatile dma_cb_t *dma_cb;
-    uint32_t dma_cb_addr;
+    volatile dma_cb_t *dma_cb[DMA_BUFFERS];   // control block for each pxl_raw buffer
+    uint32_t dma_cb_addr[DMA_BUFFERS];
+    int buffer;                               // index of the idle buffer the next frame goes to
     volatile gpio_t *gpio;
     volatile cm_clk_t *cm_clk;
-    videocore_mbox_t mbox;
+    const mbox_ops_t *mbox_ops;
+    int mbox_handle;
+    dma_mem_t dma_mem;                        // the buffers and their control block chains
     int max_count;
+    uint32_t symbols[RPI_PWM_CHANNELS][256];  // color byte -> 24 symbol bits, MSB first,
+                                              // with brightness and gamma already applied
+    int symbols_brightness[RPI_PWM_CHANNELS]; // brightness the table was built for, -1 if invalid
+    uint8_t symbols_gamma[RPI_PWM_CHANNELS][256]; // gamma table the table was built for
+    // The frame is encoded into normal cached memory first and only the words
+    // that changed are copied into the uncached DMA buffer afterwards.
+    uint32_t *staging[RPI_PWM_CHANNELS];      // one contiguous word stream per channel
+    int staging_words;                        // words per channel
+    word_range_t staging_dirty[RPI_PWM_CHANNELS];
+    encode_leds_fn encode_leds[RPI_PWM_CHANNELS]; // kernel specialized for the channel's strip_type
+    ws2811_led_t *encoded_leds[RPI_PWM_CHANNELS]; // LED values the staging buffers were encoded from
+    int encode_all[RPI_PWM_CHANNELS];         // staging doesn't match encoded_leds, re-encode everything
+    word_range_t buffer_dirty[DMA_BUFFERS];   // staging words not yet copied into each buffer
+    struct timespec completion_time;          // when the running transfer is expected to end
+    int completion_fd;                        // timerfd armed for completion_time
+    encode_worker_t workers[RPI_PWM_CHANNELS - 1]; // channel 0 is encoded by the caller
+    int worker_count;
+    int workers_stop;
+    pthread_barrier_t encode_done;            // all channels are encoded
+    uint32_t protocol_time;                   // wire time of the frame in the idle buffer [µs]
+    uint64_t previous_timestamp;              // when the last transfer was started [µs]
+    // Output thread for ws2811_render_async(), started on first use
+    pthread_t output_thread;
+    int output_running;
+    int output_stop;
+    int output_pending;                       // the idle buffer holds a frame to be started
+    ws2811_return_t output_ret;               // first error of the output thread
+    pthread_mutex_t output_lock;
+    pthread_cond_t output_cond;
 } ws2811_device_t;
 
 /**
@@ -130,6 +183,40 @@ static uint64_t get_microsecond_timestamp()
     return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
 
+/**
+ * Record when the transfer that was just started is expected to be finished
+ * and arm the completion timer for that point in time.
+ *
+ * @param    ws2811       ws2811 instance pointer.
+ * @param    duration_us  Expected duration of the transfer in microseconds.
+ *
+ * @returns  None
+ */
+static void set_completion_time(ws2811_t *ws2811, uint64_t duration_us)
+{
+    ws2811_device_t *device = ws2811->device;
+    struct timespec *t = &device->completion_time;
+    struct itimerspec timer = { .it_interval = { 0, 0 } };
+
+    if (clock_gettime(CLOCK_MONOTONIC, t) != 0) {
+        t->tv_sec = 0;
+        t->tv_nsec = 0;
+        return;
+    }
+
+    t->tv_sec += duration_us / 1000000;
+    t->tv_nsec += (duration_us % 1000000) * 1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+
+    if (device->completion_fd >= 0) {
+        timer.it_value = *t;
+        timerfd_settime(device->completion_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+    }
+}
+
 /**
  * Iterate through the channels and find the largest led count.
  *
@@ -264,23 +351,6 @@ static void unmap_registers(ws2811_t *ws2811)
     }
 }
 
-/**
- * Given a userspace address pointer, return the matching bus address used by DMA.
- *     Note: The bus address is not the same as the CPU physical address.
- *
- * @param    addr   Userspace virtual address pointer.
- *
- * @returns  Bus address for use by DMA.
- */
-static uint32_t addr_to_bus(ws2811_device_t *device, const volatile void *virt)
-{
-    videocore_mbox_t *mbox = &device->mbox;
-
-    uint32_t offset = (uint8_t *)virt - mbox->virt_addr;
-
-    return mbox->bus_addr + offset;
-}
-
 /**
  * Stop the PWM controller.
  *
@@ -340,7 +410,6 @@ static int setup_pwm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pwm_t *pwm = device->pwm;
     volatile cm_clk_t *cm_clk = device->cm_clk;
     int maxcount = device->max_count;
@@ -382,20 +451,15 @@ static int setup_pwm(ws2811_t *ws2811)
     usleep(10);
     pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
 
-    // Initialize the DMA control block
+    // Initialize the DMA control block chain of each buffer
     byte_count = PWM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
-
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-
-    dma_cb->dest_ad = (uint32_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+    dma_chain_init(&device->dma_mem, byte_count,
+                   RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                   RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                   RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                   RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
+                   RPI_DMA_TI_SRC_INC,          // Increment src addr
+                   (uint32_t)&((pwm_t *)PWM_PERIPH_PHYS)->fif1);
 
     dma->cs = 0;
     dma->txfr_len = 0;
@@ -414,7 +478,6 @@ static int setup_pcm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
     volatile pcm_t *pcm = device->pcm;
     volatile cm_clk_t *cm_clk = device->cm_clk;
     //int maxcount = max_channel_led_count(ws2811);
@@ -448,19 +511,15 @@ static int setup_pcm(ws2811_t *ws2811)
     pcm->cs |= RPI_PCM_CS_DMAEN;         // Enable DMA DREQ
     pcm->dreq = (RPI_PCM_DREQ_TX(0x3F) | RPI_PCM_DREQ_TX_PANIC(0x10)); // Set FIFO tresholds
 
-    // Initialize the DMA control block
+    // Initialize the DMA control block chain of each buffer
     byte_count = PCM_BYTE_COUNT(maxcount, freq);
-    dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                 RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                 RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                 RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
-                 RPI_DMA_TI_SRC_INC;          // Increment src addr
-
-    dma_cb->source_ad = addr_to_bus(device, device->pxl_raw);
-    dma_cb->dest_ad = (uint32_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo;
-    dma_cb->txfr_len = byte_count;
-    dma_cb->stride = 0;
-    dma_cb->nextconbk = 0;
+    dma_chain_init(&device->dma_mem, byte_count,
+                   RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                   RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                   RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                   RPI_DMA_TI_PERMAP(2) |       // PCM TX peripheral
+                   RPI_DMA_TI_SRC_INC,          // Increment src addr
+                   (uint32_t)&((pcm_t *)PCM_PERIPH_PHYS)->fifo);
 
     dma->cs = 0;
     dma->txfr_len = 0;
@@ -470,7 +529,7 @@ static int setup_pcm(ws2811_t *ws2811)
 
 /**
  * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
- * PWM channels.
+ * PWM channels.  The buffer that was just filled is handed to the DMA engine.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
@@ -481,7 +540,7 @@ static void dma_start(ws2811_t *ws2811)
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
     volatile pcm_t *pcm = device->pcm;
-    uint32_t dma_cb_addr = device->dma_cb_addr;
+    uint32_t dma_cb_addr = device->dma_cb_addr[device->buffer];
 
     dma->cs = RPI_DMA_CS_RESET;
     usleep(10);
@@ -556,20 +615,24 @@ static int gpio_init(ws2811_t *ws2811)
  */
 void pwm_raw_init(ws2811_t *ws2811)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
     int maxcount = ws2811->device->max_count;
     int wordcount = (PWM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t)) /
                     RPI_PWM_CHANNELS;
-    int chan;
+    int buf, chan;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
     {
-        int i, wordpos = chan;
+        volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw[buf];
 
-        for (i = 0; i < wordcount; i++)
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
         {
-            pxl_raw[wordpos] = 0x0;
-            wordpos += 2;
+            int i, wordpos = chan;
+
+            for (i = 0; i < wordcount; i++)
+            {
+                pxl_raw[wordpos] = 0x0;
+                wordpos += 2;
+            }
         }
     }
 }
@@ -584,281 +647,1163 @@ void pwm_raw_init(ws2811_t *ws2811)
  */
 void pcm_raw_init(ws2811_t *ws2811)
 {
-    volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw;
     int maxcount = ws2811->device->max_count;
     int wordcount = PCM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t);
-    int i;
+    int buf, i;
 
-    for (i = 0; i < wordcount; i++)
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
     {
-        pxl_raw[i] = 0x0;
+        volatile uint32_t *pxl_raw = (uint32_t *)ws2811->device->pxl_raw[buf];
+
+        for (i = 0; i < wordcount; i++)
+        {
+            pxl_raw[i] = 0x0;
+        }
     }
 }
 
 /**
- * Cleanup previously allocated device memory and buffers.
+ * Rebuild the per-channel lookup tables that expand a color byte into its 24
+ * symbol bits if the channel's brightness or gamma table changed.  Brightness
+ * scaling and gamma correction are folded into the table, so encoding takes a
+ * single lookup per color component.  Inversion is handled by hardware for
+ * PWM, so only PCM and SPI channels get an inverted table.  A rebuilt table
+ * invalidates everything encoded with the old one.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
  * @returns  None
  */
-void ws2811_cleanup(ws2811_t *ws2811)
+static void update_symbol_tables(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     int chan;
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        if (ws2811->channel && ws2811->channel[chan].leds)
-        {
-            free(ws2811->channel[chan].leds);
-        }
-        ws2811->channel[chan].leds = NULL;
-        if (ws2811->channel && ws2811->channel[chan].gamma)
+        ws2811_channel_t *channel = &ws2811->channel[chan];
+        int invert = (device->driver_mode != PWM) && channel->invert;
+        uint32_t symbol_low = invert ? SYMBOL_LOW_INV : SYMBOL_LOW;
+        uint32_t symbol_high = invert ? SYMBOL_HIGH_INV : SYMBOL_HIGH;
+        const int scale = (channel->brightness & 0xff) + 1;
+        int value, k;
+
+        if ((device->symbols_brightness[chan] == channel->brightness) &&
+            !memcmp(device->symbols_gamma[chan], channel->gamma, sizeof(device->symbols_gamma[chan])))
         {
-            free(ws2811->channel[chan].gamma);
+            continue;
         }
-        ws2811->channel[chan].gamma = NULL;
-    }
-
-    if (device->mbox.handle != -1)
-    {
-        videocore_mbox_t *mbox = &device->mbox;
 
-        unmapmem(mbox->virt_addr, mbox->size);
-        mem_unlock(mbox->handle, mbox->mem_ref);
-        mem_free(mbox->handle, mbox->mem_ref);
-        mbox_close(mbox->handle);
+        for (value = 0; value < 256; value++)
+        {
+            uint8_t corrected = channel->gamma[(value * scale) >> 8];
+            uint32_t bits = 0;
 
-        mbox->handle = -1;
-    }
+            for (k = 7; k >= 0; k--)
+            {
+                bits = (bits << 3) | ((corrected & (1 << k)) ? symbol_high : symbol_low);
+            }
 
-    if (device && (device->spi_fd > 0))
-    {
-        close(device->spi_fd);
-    }
+            device->symbols[chan][value] = bits;
+        }
 
-    if (device) {
-        free(device);
+        device->symbols_brightness[chan] = channel->brightness;
+        memcpy(device->symbols_gamma[chan], channel->gamma, sizeof(device->symbols_gamma[chan]));
+        device->encode_all[chan] = 1;
     }
-    ws2811->device = NULL;
 }
 
-static int set_driver_mode(ws2811_t *ws2811, int gpionum)
+/**
+ * Store 4 symbol groups of 24 bits as 3 whole words.
+ *
+ * @param    wordptr  Where to store the words.
+ * @param    s0..s3   Symbol bits of 4 consecutive color bytes.
+ *
+ * @returns  Pointer past the last stored word.
+ */
+static inline __attribute__((always_inline))
+uint32_t *put_symbols4(uint32_t *wordptr, uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3)
 {
-    int gpionum2;
-
-    if (gpionum == 18 || gpionum == 12) {
-        ws2811->device->driver_mode = PWM;
-        // Check gpio for PWM1 (2nd channel) is OK if used
-        gpionum2 = ws2811->channel[1].gpionum;
-        if (gpionum2 == 0 || gpionum2 == 13 || gpionum2 == 19) {
-            return 0;
-        }
-    }
-    else if (gpionum == 21 || gpionum == 31) {
-        ws2811->device->driver_mode = PCM;
-    }
-    else if (gpionum == 10) {
-        ws2811->device->driver_mode = SPI;
-    }
-    else {
-        fprintf(stderr, "gpionum %d not allowed\n", gpionum);
-        return -1;
-    }
-    // For PCM and SPI zero the 2nd channel
-    memset(&ws2811->channel[1], 0, sizeof(ws2811_channel_t));
+    wordptr[0] = (s0 << 8) | (s1 >> 16);
+    wordptr[1] = (s1 << 16) | (s2 >> 8);
+    wordptr[2] = (s2 << 24) | s3;
 
-    return 0;
+    return wordptr + 3;
 }
 
-static int check_hwver_and_gpionum(ws2811_t *ws2811)
+/**
+ * Encode kernel shared by all color layouts.  It's always inlined so that the
+ * wrappers below, which pass a constant strip_type, get the byte order and the
+ * RGB/RGBW decision resolved at compile time.  RGBW LEDs are exactly 3 words
+ * each.  RGB LEDs are done 4 at a time, 3 words per 4 color bytes, and only
+ * the last LEDs of a channel go through the accumulator.
+ *
+ * @param    symbols     Channel symbol table.
+ * @param    leds        First LED to encode.
+ * @param    count       Number of LEDs to encode.
+ * @param    wordptr     Word stream position of the first LED.
+ * @param    strip_type  One of the WS2811_STRIP_xxx / SK6812_STRIP_xxx constants.
+ *
+ * @returns  Pointer past the last word written.
+ */
+static inline __attribute__((always_inline))
+uint32_t *encode_leds(const uint32_t *symbols, const ws2811_led_t *leds, int count,
+                      uint32_t *wordptr, int strip_type)
 {
-    const rpi_hw_t *rpi_hw;
-    int hwver, gpionum;
-    int gpionums_B1[] = { 10, 18, 21 };
-    int gpionums_B2[] = { 10, 18, 31 };
-    int gpionums_40p[] = { 10, 12, 18, 21};
-    int i;
+    const int wshift = (strip_type >> 24) & 0xff;
+    const int rshift = (strip_type >> 16) & 0xff;
+    const int gshift = (strip_type >> 8)  & 0xff;
+    const int bshift = (strip_type >> 0)  & 0xff;
+    uint64_t acc = 0;
+    int nbits = 0;
+    int i = 0;
 
-    rpi_hw = ws2811->rpi_hw;
-    hwver = rpi_hw->hwver & 0x0000ffff;
-    gpionum = ws2811->channel[0].gpionum;
-    if (hwver < 0x0004)  // Model B Rev 1
+#define SYMBOLS(led, shift)                      symbols[((led) >> (shift)) & 0xff]
+
+    if (strip_type & SK6812_SHIFT_WMASK)
     {
-        for ( i = 0; i < (int)(sizeof(gpionums_B1) / sizeof(gpionums_B1[0])); i++)
+        for (i = 0; i < count; i++)
         {
-            if (gpionums_B1[i] == gpionum) {
-                // Set driver mode (PWM, PCM, or SPI)
-                return set_driver_mode(ws2811, gpionum);
-            }
+            wordptr = put_symbols4(wordptr,
+                                   SYMBOLS(leds[i], rshift), SYMBOLS(leds[i], gshift),
+                                   SYMBOLS(leds[i], bshift), SYMBOLS(leds[i], wshift));
         }
+
+        return wordptr;
     }
-    else if (hwver >= 0x0004 && hwver <= 0x000f)  // Models B Rev2, A
+
+    for (i = 0; i + 4 <= count; i += 4)
     {
-        for ( i = 0; i < (int)(sizeof(gpionums_B2) / sizeof(gpionums_B2[0])); i++)
-        {
-            if (gpionums_B2[i] == gpionum) {
-                // Set driver mode (PWM, PCM, or SPI)
-                return set_driver_mode(ws2811, gpionum);
-            }
-        }
-    }
-    else if (hwver >= 0x010) // Models B+, A+, 2B, 3B, Zero Zero-W
+        wordptr = put_symbols4(wordptr,
+                               SYMBOLS(leds[i + 0], rshift), SYMBOLS(leds[i + 0], gshift),
+                               SYMBOLS(leds[i + 0], bshift), SYMBOLS(leds[i + 1], rshift));
+        wordptr = put_symbols4(wordptr,
+                               SYMBOLS(leds[i + 1], gshift), SYMBOLS(leds[i + 1], bshift),
+                               SYMBOLS(leds[i + 2], rshift), SYMBOLS(leds[i + 2], gshift));
+        wordptr = put_symbols4(wordptr,
+                               SYMBOLS(leds[i + 2], bshift), SYMBOLS(leds[i + 3], rshift),
+                               SYMBOLS(leds[i + 3], gshift), SYMBOLS(leds[i + 3], bshift));
+    }
+
+    for (; i < count; i++)
     {
-        if ((ws2811->channel[0].count == 0) && (ws2811->channel[1].count > 0))
+        const uint32_t bits[] =
         {
-            // Special case: nothing in channel 0, channel 1 only PWM1 allowed
-            // PWM1 only available on 40 pin GPIO interface
-            gpionum = ws2811->channel[1].gpionum;
-            if ((gpionum == 13) || (gpionum == 19))
+            SYMBOLS(leds[i], rshift), SYMBOLS(leds[i], gshift), SYMBOLS(leds[i], bshift),
+        };
+        int j;
+
+        for (j = 0; j < 3; j++)
+        {
+            acc = (acc << SYMBOL_BITS_PER_BYTE) | bits[j];
+            nbits += SYMBOL_BITS_PER_BYTE;
+
+            if (nbits >= 32)
             {
-                ws2811->device->driver_mode = PWM;
-                return 0;
-            }
-            else {
-                return -1;
+                nbits -= 32;
+                *wordptr++ = (uint32_t)(acc >> nbits);
             }
         }
-        for ( i = 0; i < (int)(sizeof(gpionums_40p) / sizeof(gpionums_40p[0])); i++)
+    }
+
+#undef SYMBOLS
+
+    // Pad the last partial word with low bits, same as the idle time after it
+    if (nbits)
+    {
+        *wordptr++ = (uint32_t)(acc << (32 - nbits));
+    }
+
+    return wordptr;
+}
+
+#define ENCODE_LEDS_SPECIALIZED(strip)                                                      \
+    static uint32_t *encode_leds_##strip(const uint32_t *symbols, const ws2811_led_t *leds, \
+                                         int count, uint32_t *wordptr, int strip_type)      \
+    {                                                                                       \
+        (void)strip_type;                                                                   \
+        return encode_leds(symbols, leds, count, wordptr, strip);                           \
+    }
+
+ENCODE_LEDS_SPECIALIZED(SK6812_STRIP_RGBW)
+ENCODE_LEDS_SPECIALIZED(SK6812_STRIP_RBGW)
+ENCODE_LEDS_SPECIALIZED(SK6812_STRIP_GRBW)
+ENCODE_LEDS_SPECIALIZED(SK6812_STRIP_GBRW)
+ENCODE_LEDS_SPECIALIZED(SK6812_STRIP_BRGW)
+ENCODE_LEDS_SPECIALIZED(SK6812_STRIP_BGRW)
+ENCODE_LEDS_SPECIALIZED(WS2811_STRIP_RGB)
+ENCODE_LEDS_SPECIALIZED(WS2811_STRIP_RBG)
+ENCODE_LEDS_SPECIALIZED(WS2811_STRIP_GRB)
+ENCODE_LEDS_SPECIALIZED(WS2811_STRIP_GBR)
+ENCODE_LEDS_SPECIALIZED(WS2811_STRIP_BRG)
+ENCODE_LEDS_SPECIALIZED(WS2811_STRIP_BGR)
+
+/**
+ * Fallback for custom strip_type values, byte order is resolved at runtime.
+ */
+static uint32_t *encode_leds_generic(const uint32_t *symbols, const ws2811_led_t *leds,
+                                     int count, uint32_t *wordptr, int strip_type)
+{
+    return encode_leds(symbols, leds, count, wordptr, strip_type);
+}
+
+/**
+ * Pick the encode kernel for a color layout.
+ *
+ * @param    strip_type  Channel strip_type.
+ *
+ * @returns  Kernel specialized for strip_type, or the generic one.
+ */
+static encode_leds_fn select_encoder(int strip_type)
+{
+    static const struct {
+        int strip_type;
+        encode_leds_fn encode_leds;
+    } encoders[] = {
+        { SK6812_STRIP_RGBW, encode_leds_SK6812_STRIP_RGBW },
+        { SK6812_STRIP_RBGW, encode_leds_SK6812_STRIP_RBGW },
+        { SK6812_STRIP_GRBW, encode_leds_SK6812_STRIP_GRBW },
+        { SK6812_STRIP_GBRW, encode_leds_SK6812_STRIP_GBRW },
+        { SK6812_STRIP_BRGW, encode_leds_SK6812_STRIP_BRGW },
+        { SK6812_STRIP_BGRW, encode_leds_SK6812_STRIP_BGRW },
+        { WS2811_STRIP_RGB, encode_leds_WS2811_STRIP_RGB },
+        { WS2811_STRIP_RBG, encode_leds_WS2811_STRIP_RBG },
+        { WS2811_STRIP_GRB, encode_leds_WS2811_STRIP_GRB },
+        { WS2811_STRIP_GBR, encode_leds_WS2811_STRIP_GBR },
+        { WS2811_STRIP_BRG, encode_leds_WS2811_STRIP_BRG },
+        { WS2811_STRIP_BGR, encode_leds_WS2811_STRIP_BGR },
+    };
+    int i;
+
+    for (i = 0; i < (int)(sizeof(encoders) / sizeof(encoders[0])); i++)
+    {
+        if (encoders[i].strip_type == strip_type)
         {
-            if (gpionums_40p[i] == gpionum) {
-                // Set driver mode (PWM, PCM, or SPI)
-                return set_driver_mode(ws2811, gpionum);
-            }
+            return encoders[i].encode_leds;
         }
     }
-    fprintf(stderr, "Gpio %d is illegal for LED channel 0\n", gpionum);
-    return -1;
+
+    return encode_leds_generic;
 }
 
-static ws2811_return_t spi_init(ws2811_t *ws2811)
+/**
+ * Allocate the cached staging buffers, one word stream per channel.  They start
+ * out all zero, matching the freshly initialized DMA buffer.  Each channel also
+ * gets a copy of the LED values that were last encoded, so the next frame only
+ * needs to re-encode the LEDs that changed.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int staging_init(ws2811_t *ws2811)
 {
-    int spi_fd;
-    static uint8_t mode;
-    static uint8_t bits = 8;
-    uint32_t speed = ws2811->freq * 3;
     ws2811_device_t *device = ws2811->device;
-    uint32_t base = ws2811->rpi_hw->periph_base;
-    int pinnum = ws2811->channel[0].gpionum;
+    int chan, buf;
 
-    spi_fd = open("/dev/spidev0.0", O_RDWR);
-    if (spi_fd < 0) {
-        fprintf(stderr, "Cannot open /dev/spidev0.0. spi_bcm2835 module not loaded?\n");
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    device->spi_fd = spi_fd;
+    device->staging_words = PCM_BYTE_COUNT(device->max_count, ws2811->freq) / sizeof(uint32_t);
 
-    // SPI mode
-    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &mode) < 0)
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
-        return WS2811_ERROR_SPI_SETUP;
-    }
+        device->staging[chan] = calloc(device->staging_words, sizeof(uint32_t));
+        if (!device->staging[chan])
+        {
+            return -1;
+        }
 
-    // Bits per word
-    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
-    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
-    }
+        device->staging_dirty[chan].first = 0;
+        device->staging_dirty[chan].last = 0;
 
-    // Max speed Hz
-    if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
-    {
-        return WS2811_ERROR_SPI_SETUP;
+        device->encoded_leds[chan] = calloc(ws2811->channel[chan].count + 1, sizeof(ws2811_led_t));
+        if (!device->encoded_leds[chan])
+        {
+            return -1;
+        }
+
+        device->encode_leds[chan] = select_encoder(ws2811->channel[chan].strip_type);
+
+        // An all-zero DMA buffer doesn't correspond to any LED values
+        device->encode_all[chan] = 1;
+        device->symbols_brightness[chan] = -1;
     }
-    if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
+
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        device->buffer_dirty[buf].first = 0;
+        device->buffer_dirty[buf].last = 0;
     }
+    device->buffer = 0;
 
-    // Initialize device structure elements to not used
-    // except driver_mode, spi_fd and max_count (already defined when spi_init called)
-    device->pxl_raw = NULL;
-    device->dma = NULL;
-    device->pwm = NULL;
-    device->pcm = NULL;
-    device->dma_cb = NULL;
-    device->dma_cb_addr = 0;
-    device->cm_clk = NULL;
-    device->mbox.handle = -1;
+    return 0;
+}
 
-    // Set SPI-MOSI pin
-    device->gpio = mapmem(GPIO_OFFSET + base, sizeof(gpio_t), DEV_GPIOMEM);
-    if (!device->gpio)
+/**
+ * Grow a word range so it also covers another one.
+ *
+ * @param    range  Range to grow.
+ * @param    other  Range to include, may be empty.
+ *
+ * @returns  None
+ */
+static void word_range_merge(word_range_t *range, const word_range_t *other)
+{
+    if (other->first >= other->last)
     {
-        return WS2811_ERROR_SPI_SETUP;
+        return;
     }
-    gpio_function_set(device->gpio, pinnum, 0);	// SPI-MOSI ALT0
 
-    // Allocate LED buffer
-    ws2811_channel_t *channel = &ws2811->channel[0];
-    channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
-    if (!channel->leds)
-    {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
-    }
-    memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
-    if (!channel->strip_type)
+    if (range->first >= range->last)
     {
-      channel->strip_type=WS2811_STRIP_RGB;
+        *range = *other;
+        return;
     }
 
-    // Set default uncorrected gamma table
-    if (!channel->gamma)
+    if (other->first < range->first)
     {
-      channel->gamma = malloc(sizeof(uint8_t) * 256);
-      int x;
-      for(x = 0; x < 256; x++){
-        channel->gamma[x] = x;
-      }
+        range->first = other->first;
     }
-
-    channel->wshift = (channel->strip_type >> 24) & 0xff;
-    channel->rshift = (channel->strip_type >> 16) & 0xff;
-    channel->gshift = (channel->strip_type >> 8)  & 0xff;
-    channel->bshift = (channel->strip_type >> 0)  & 0xff;
-
-    // Allocate SPI transmit buffer (same size as PCM)
-    device->pxl_raw = malloc(PCM_BYTE_COUNT(device->max_count, ws2811->freq));
-    if (device->pxl_raw == NULL)
+    if (other->last > range->last)
     {
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_OUT_OF_MEMORY;
+        range->last = other->last;
     }
-    pcm_raw_init(ws2811);
-
-    return WS2811_SUCCESS;
 }
 
-static ws2811_return_t spi_transfer(ws2811_t *ws2811)
-{
+/**
+ * Encode a span of LEDs of one channel into its staging word stream.  The
+ * span must start on a word boundary and end on one or at the end of the
+ * channel.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel to encode.
+ * @param    first   First LED to encode.
+ * @param    last    One past the last LED to encode.
+ *
+ * @returns  None
+ */
+static void encode_span(ws2811_t *ws2811, int chan, int first, int last)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    const int array_size = (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    const int first_word = first * array_size * SYMBOL_BITS_PER_BYTE / 32;
+    uint32_t *end;
+
+    end = device->encode_leds[chan](device->symbols[chan], &channel->leds[first], last - first,
+                                    &device->staging[chan][first_word], channel->strip_type);
+
+    word_range_merge(&device->staging_dirty[chan],
+                     &(word_range_t){ first_word, end - device->staging[chan] });
+}
+
+/**
+ * Re-encode the LEDs of one channel that changed since the last frame.  Every
+ * run of changed LEDs is widened to whole words, which is a group of 4 LEDs
+ * for RGB strips and a single LED for RGBW strips.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel to encode.
+ *
+ * @returns  Number of LEDs that were encoded.
+ */
+static int encode_channel(ws2811_t *ws2811, int chan)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    const ws2811_led_t *leds = channel->leds;
+    ws2811_led_t *encoded_leds = device->encoded_leds[chan];
+    const int array_size = (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+    const int align = (array_size == 4) ? 1 : 4;
+    const int all = device->encode_all[chan];
+    int encoded = 0;
+    int i = 0;
+
+    while (i < channel->count)
+    {
+        int first, last;
+
+        if (!all && (leds[i] == encoded_leds[i]))
+        {
+            i++;
+            continue;
+        }
+
+        first = i - (i % align);
+        while ((i < channel->count) && (all || (leds[i] != encoded_leds[i])))
+        {
+            i++;
+        }
+        last = i + (align - (i % align)) % align;
+        if (last > channel->count)
+        {
+            last = channel->count;
+        }
+
+        encode_span(ws2811, chan, first, last);
+        memcpy(&encoded_leds[first], &leds[first], (last - first) * sizeof(ws2811_led_t));
+        encoded += last - first;
+        i = last;
+    }
+
+    device->encode_all[chan] = 0;
+
+    return encoded;
+}
+
+/**
+ * Worker thread main loop, encodes its channel whenever ws2811_render posts
+ * the start semaphore and reports back through the done barrier.
+ *
+ * @param    arg  encode_worker_t of this thread.
+ *
+ * @returns  NULL
+ */
+static void *encode_worker_main(void *arg)
+{
+    encode_worker_t *worker = arg;
+    ws2811_device_t *device = worker->ws2811->device;
+
+    for (;;)
+    {
+        while (sem_wait(&worker->start) && (errno == EINTR))
+            ;
+        if (device->workers_stop)
+        {
+            break;
+        }
+
+        worker->encoded = encode_channel(worker->ws2811, worker->chan);
+        pthread_barrier_wait(&device->encode_done);
+    }
+
+    return NULL;
+}
+
+/**
+ * Stop and join the worker threads.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void encode_workers_stop(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i;
+
+    device->workers_stop = 1;
+    for (i = 0; i < device->worker_count; i++)
+    {
+        sem_post(&device->workers[i].start);
+        pthread_join(device->workers[i].thread, NULL);
+        sem_destroy(&device->workers[i].start);
+    }
+    device->worker_count = 0;
+}
+
+/**
+ * Start one worker thread for every used channel except channel 0, each
+ * pinned to its own CPU core.  Does nothing on single core machines, where
+ * the channels are encoded one after the other by the caller.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, -1 otherwise.
+ */
+static int encode_workers_start(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int chan;
+
+    device->worker_count = 0;
+    device->workers_stop = 0;
+    if (cpus < 2)
+    {
+        return 0;
+    }
+
+    for (chan = 1; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        encode_worker_t *worker = &device->workers[device->worker_count];
+        cpu_set_t cpuset;
+
+        if (ws2811->channel[chan].count <= 0)
+        {
+            continue;
+        }
+
+        worker->ws2811 = ws2811;
+        worker->chan = chan;
+        sem_init(&worker->start, 0, 0);
+
+        if (pthread_create(&worker->thread, NULL, encode_worker_main, worker))
+        {
+            sem_destroy(&worker->start);
+            encode_workers_stop(ws2811);
+            return -1;
+        }
+        device->worker_count++;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(chan % cpus, &cpuset);
+        pthread_setaffinity_np(worker->thread, sizeof(cpuset), &cpuset);
+    }
+
+    if (device->worker_count)
+    {
+        pthread_barrier_init(&device->encode_done, NULL, device->worker_count + 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the worker threads and release the barrier they share.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void encode_workers_fini(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (device->worker_count)
+    {
+        encode_workers_stop(ws2811);
+        pthread_barrier_destroy(&device->encode_done);
+    }
+}
+
+/**
+ * Encode all channels, in parallel if worker threads are running.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Number of LEDs that were encoded.
+ */
+static int encode_channels(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int encoded = 0;
+    int chan, i;
+
+    if (!device->worker_count)
+    {
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            encoded += encode_channel(ws2811, chan);
+        }
+
+        return encoded;
+    }
+
+    for (i = 0; i < device->worker_count; i++)
+    {
+        sem_post(&device->workers[i].start);
+    }
+    encoded = encode_channel(ws2811, 0);
+    pthread_barrier_wait(&device->encode_done);
+
+    for (i = 0; i < device->worker_count; i++)
+    {
+        encoded += device->workers[i].encoded;
+    }
+
+    return encoded;
+}
+
+/**
+ * Copy the changed part of the staging buffers into the idle DMA (or SPI
+ * transmit) buffer.  A buffer also receives the changes of the frames that
+ * went to the other buffer since it was last filled.  Each changed region is
+ * written in one sequential pass: interleaved word by word for the two PWM
+ * channels, as-is for PCM, and byte-swapped to MSB-first byte order for SPI.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void staging_flush(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    volatile uint32_t *dest = (volatile uint32_t *)device->pxl_raw[device->buffer];
+    word_range_t range;
+    int chan, buf, i;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        for (buf = 0; buf < DMA_BUFFERS; buf++)
+        {
+            word_range_merge(&device->buffer_dirty[buf], &device->staging_dirty[chan]);
+        }
+        device->staging_dirty[chan].first = device->staging_words;
+        device->staging_dirty[chan].last = 0;
+    }
+
+    range = device->buffer_dirty[device->buffer];
+    device->buffer_dirty[device->buffer].first = device->staging_words;
+    device->buffer_dirty[device->buffer].last = 0;
+
+    if (range.first >= range.last)
+    {
+        return;
+    }
+
+    switch (device->driver_mode) {
+    case PWM:
+        for (i = range.first; i < range.last; i++)
+        {
+            for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+            {
+                dest[i * RPI_PWM_CHANNELS + chan] = device->staging[chan][i];
+            }
+        }
+        break;
+
+    case PCM:
+        memcpy((uint32_t *)&dest[range.first], &device->staging[0][range.first],
+               (range.last - range.first) * sizeof(uint32_t));
+        break;
+
+    case SPI:
+        for (i = range.first; i < range.last; i++)
+        {
+            dest[i] = htonl(device->staging[0][i]);
+        }
+        break;
+    }
+}
+
+/**
+ * Block until the output thread has started the pending frame, if any.  The
+ * idle buffer is free to be filled afterwards.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void output_thread_sync(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (!device->output_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&device->output_lock);
+    while (device->output_pending)
+    {
+        pthread_cond_wait(&device->output_cond, &device->output_lock);
+    }
+    pthread_mutex_unlock(&device->output_lock);
+}
+
+/**
+ * Send out any pending frame and stop the output thread.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void output_thread_stop(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    if (!device->output_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&device->output_lock);
+    device->output_stop = 1;
+    pthread_cond_broadcast(&device->output_cond);
+    pthread_mutex_unlock(&device->output_lock);
+
+    pthread_join(device->output_thread, NULL);
+    pthread_cond_destroy(&device->output_cond);
+    pthread_mutex_destroy(&device->output_lock);
+    device->output_running = 0;
+}
+
+/**
+ * Cleanup previously allocated device memory and buffers.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_cleanup(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int chan;
+
+    if (device)
+    {
+        output_thread_stop(ws2811);
+        encode_workers_fini(ws2811);
+    }
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (ws2811->channel && ws2811->channel[chan].leds)
+        {
+            free(ws2811->channel[chan].leds);
+        }
+        ws2811->channel[chan].leds = NULL;
+        if (ws2811->channel && ws2811->channel[chan].gamma)
+        {
+            free(ws2811->channel[chan].gamma);
+        }
+        ws2811->channel[chan].gamma = NULL;
+
+        if (device && device->staging[chan])
+        {
+            free(device->staging[chan]);
+            device->staging[chan] = NULL;
+        }
+        if (device && device->encoded_leds[chan])
+        {
+            free(device->encoded_leds[chan]);
+            device->encoded_leds[chan] = NULL;
+        }
+    }
+
+    if (device)
+    {
+        device->backend->fini(device->backend, ws2811);
+    }
+
+    if (device && (device->completion_fd >= 0))
+    {
+        close(device->completion_fd);
+    }
+
+    if (device) {
+        free(device);
+    }
+    ws2811->device = NULL;
+}
+
+static int set_driver_mode(ws2811_t *ws2811, int gpionum)
+{
+    int gpionum2;
+
+    if (gpionum == 18 || gpionum == 12) {
+        ws2811->device->driver_mode = PWM;
+        // Check gpio for PWM1 (2nd channel) is OK if used
+        gpionum2 = ws2811->channel[1].gpionum;
+        if (gpionum2 == 0 || gpionum2 == 13 || gpionum2 == 19) {
+            return 0;
+        }
+    }
+    else if (gpionum == 21 || gpionum == 31) {
+        ws2811->device->driver_mode = PCM;
+    }
+    else if (gpionum == 10) {
+        ws2811->device->driver_mode = SPI;
+    }
+    else {
+        fprintf(stderr, "gpionum %d not allowed\n", gpionum);
+        return -1;
+    }
+    // For PCM and SPI zero the 2nd channel
+    memset(&ws2811->channel[1], 0, sizeof(ws2811_channel_t));
+
+    return 0;
+}
+
+static int check_hwver_and_gpionum(ws2811_t *ws2811)
+{
+    const rpi_hw_t *rpi_hw;
+    int hwver, gpionum;
+    int gpionums_B1[] = { 10, 18, 21 };
+    int gpionums_B2[] = { 10, 18, 31 };
+    int gpionums_40p[] = { 10, 12, 18, 21};
+    int i;
+
+    rpi_hw = ws2811->rpi_hw;
+    hwver = rpi_hw->hwver & 0x0000ffff;
+    gpionum = ws2811->channel[0].gpionum;
+    if (hwver < 0x0004)  // Model B Rev 1
+    {
+        for ( i = 0; i < (int)(sizeof(gpionums_B1) / sizeof(gpionums_B1[0])); i++)
+        {
+            if (gpionums_B1[i] == gpionum) {
+                // Set driver mode (PWM, PCM, or SPI)
+                return set_driver_mode(ws2811, gpionum);
+            }
+        }
+    }
+    else if (hwver >= 0x0004 && hwver <= 0x000f)  // Models B Rev2, A
+    {
+        for ( i = 0; i < (int)(sizeof(gpionums_B2) / sizeof(gpionums_B2[0])); i++)
+        {
+            if (gpionums_B2[i] == gpionum) {
+                // Set driver mode (PWM, PCM, or SPI)
+                return set_driver_mode(ws2811, gpionum);
+            }
+        }
+    }
+    else if (hwver >= 0x010) // Models B+, A+, 2B, 3B, Zero Zero-W
+    {
+        if ((ws2811->channel[0].count == 0) && (ws2811->channel[1].count > 0))
+        {
+            // Special case: nothing in channel 0, channel 1 only PWM1 allowed
+            // PWM1 only available on 40 pin GPIO interface
+            gpionum = ws2811->channel[1].gpionum;
+            if ((gpionum == 13) || (gpionum == 19))
+            {
+                ws2811->device->driver_mode = PWM;
+                return 0;
+            }
+            else {
+                return -1;
+            }
+        }
+        for ( i = 0; i < (int)(sizeof(gpionums_40p) / sizeof(gpionums_40p[0])); i++)
+        {
+            if (gpionums_40p[i] == gpionum) {
+                // Set driver mode (PWM, PCM, or SPI)
+                return set_driver_mode(ws2811, gpionum);
+            }
+        }
+    }
+    fprintf(stderr, "Gpio %d is illegal for LED channel 0\n", gpionum);
+    return -1;
+}
+
+static ws2811_return_t spi_init(ws2811_t *ws2811, uint32_t byte_count)
+{
+    int spi_fd;
+    static uint8_t mode;
+    static uint8_t bits = 8;
+    uint32_t speed = ws2811->freq * 3;
+    ws2811_device_t *device = ws2811->device;
+    uint32_t base = ws2811->rpi_hw->periph_base;
+    int pinnum = ws2811->channel[0].gpionum;
+    int buf;
+
+    spi_fd = open("/dev/spidev0.0", O_RDWR);
+    if (spi_fd < 0) {
+        fprintf(stderr, "Cannot open /dev/spidev0.0. spi_bcm2835 module not loaded?\n");
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    device->spi_fd = spi_fd;
+
+    // SPI mode
+    if (ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_MODE, &mode) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Bits per word
+    if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Max speed Hz
+    if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    if (ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+
+    // Initialize device structure elements to not used
+    // except driver_mode, spi_fd and max_count (already defined when spi_init called)
+    device->pxl_raw[0] = NULL;
+    device->pxl_raw[1] = NULL;
+    device->dma = NULL;
+    device->pwm = NULL;
+    device->pcm = NULL;
+    device->dma_cb[0] = NULL;
+    device->dma_cb[1] = NULL;
+    device->dma_cb_addr[0] = 0;
+    device->dma_cb_addr[1] = 0;
+    device->cm_clk = NULL;
+    device->mbox_handle = -1;
+
+    // Set SPI-MOSI pin
+    device->gpio = mapmem(GPIO_OFFSET + base, sizeof(gpio_t), DEV_GPIOMEM);
+    if (!device->gpio)
+    {
+        return WS2811_ERROR_SPI_SETUP;
+    }
+    gpio_function_set(device->gpio, pinnum, 0);	// SPI-MOSI ALT0
+
+    // Allocate SPI transmit buffers (same size as PCM)
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
+    {
+        device->pxl_raw[buf] = malloc(byte_count);
+        if (device->pxl_raw[buf] == NULL)
+        {
+            return WS2811_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    return WS2811_SUCCESS;
+}
+
+static ws2811_return_t spi_transfer(ws2811_t *ws2811)
+{
     int ret;
     struct spi_ioc_transfer tr;
 
-    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
-    tr.tx_buf = (unsigned long)ws2811->device->pxl_raw;
-    tr.rx_buf = 0;
-    tr.len = PCM_BYTE_COUNT(ws2811->device->max_count, ws2811->freq);
+    memset(&tr, 0, sizeof(struct spi_ioc_transfer));
+    tr.tx_buf = (unsigned long)ws2811->device->pxl_raw[ws2811->device->buffer];
+    tr.rx_buf = 0;
+    tr.len = PCM_BYTE_COUNT(ws2811->device->max_count, ws2811->freq);
+
+    ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
+    if (ret < 1)
+    {
+        fprintf(stderr, "Can't send spi message");
+        return WS2811_ERROR_SPI_TRANSFER;
+    }
+
+    return WS2811_SUCCESS;
+}
+
+
+/**
+ * Detect the Pi model from the running system.
+ *
+ * @param    backend  Backend instance pointer.
+ *
+ * @returns  Hardware description, NULL if the model is not supported.
+ */
+static const rpi_hw_t *hw_detect(ws2811_backend_t *backend)
+{
+    (void)backend;
+
+    return rpi_hw_detect();
+}
+
+/**
+ * Allocate the transmit buffers and set up the peripherals of the Pi.
+ *
+ * @param    backend     Backend instance pointer.
+ * @param    ws2811      ws2811 instance pointer.
+ * @param    mode        Driver mode, PWM, PCM or SPI.
+ * @param    byte_count  Size of each transmit buffer in bytes.
+ * @param    pxl_raw     Receives the transmit buffers, the device's own array.
+ *
+ * @returns  0 on success, < 0 on error.
+ */
+static ws2811_return_t hw_init(ws2811_backend_t *backend, ws2811_t *ws2811, int mode,
+                               uint32_t byte_count, volatile uint8_t *pxl_raw[DMA_BUFFERS])
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+    int buf;
+
+    (void)backend;
+    (void)pxl_raw;  // filled in through the device
+
+    if (mode == SPI)
+    {
+        return spi_init(ws2811, byte_count);
+    }
+
+    device->mbox_handle = device->mbox_ops->open();
+    if (device->mbox_handle == -1)
+    {
+        return WS2811_ERROR_MAILBOX_DEVICE;
+    }
+
+    // Control blocks go first to keep their 256-bit alignment, followed by the buffers
+    if ((ret = dma_mem_alloc(&device->dma_mem, device->mbox_ops, device->mbox_handle,
+                             ws2811->rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4,
+                             byte_count)) != WS2811_SUCCESS)
+    {
+        return ret;
+    }
+
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
+    {
+        device->dma_cb[buf] = device->dma_mem.cb[buf];
+        device->pxl_raw[buf] = device->dma_mem.buf[buf];
+        memset((dma_cb_t *)device->dma_cb[buf], 0, device->dma_mem.cb_count * sizeof(dma_cb_t));
+
+        // Cache the DMA control block bus address
+        device->dma_cb_addr[buf] = dma_mem_bus_addr(&device->dma_mem, device->dma_cb[buf]);
+    }
+
+    // Map the physical registers into userspace
+    if (map_registers(ws2811))
+    {
+        return WS2811_ERROR_MAP_REGISTERS;
+    }
+
+    // Initialize the GPIO pins
+    if (gpio_init(ws2811))
+    {
+        return WS2811_ERROR_GPIO_INIT;
+    }
+
+    switch (mode) {
+    case PWM:
+        // Setup the PWM, clocks, and DMA
+        if (setup_pwm(ws2811))
+        {
+            return WS2811_ERROR_PWM_SETUP;
+        }
+        break;
+    case PCM:
+    // Setup the PCM, clock, and DMA
+        if (setup_pcm(ws2811))
+        {
+            return WS2811_ERROR_PCM_SETUP;
+        }
+        break;
+    }
+    device->hw_running = 1;
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Start the DMA engine, or the SPI transfer, on the given buffer.
+ *
+ * @param    backend      Backend instance pointer.
+ * @param    ws2811       ws2811 instance pointer.
+ * @param    buffer       Index of the buffer to send.
+ * @param    duration_us  Receives the time until the transfer is done.
+ *
+ * @returns  0 on success, < 0 on error.
+ */
+static ws2811_return_t hw_start(ws2811_backend_t *backend, ws2811_t *ws2811, int buffer,
+                                uint64_t *duration_us)
+{
+    ws2811_device_t *device = ws2811->device;
+
+    (void)backend;
+    (void)buffer;  // always device->buffer
 
-    ret = ioctl(ws2811->device->spi_fd, SPI_IOC_MESSAGE(1), &tr);
-    if (ret < 1)
+    if (device->driver_mode == SPI)
     {
-        fprintf(stderr, "Can't send spi message");
-        return WS2811_ERROR_SPI_TRANSFER;
+        // The transfer is synchronous, so it's already complete
+        *duration_us = 0;
+
+        return spi_transfer(ws2811);
+    }
+
+    dma_start(ws2811);
+
+    // The whole buffer is clocked out, including the reset time padding,
+    // at 3 symbols per bit.
+    *duration_us = (uint64_t)device->staging_words * 32 * 1000000 / (3 * ws2811->freq);
+
+    return WS2811_SUCCESS;
+}
+
+/**
+ * Wait until the DMA engine is done with the current buffer.
+ *
+ * @param    backend  Backend instance pointer.
+ * @param    ws2811   ws2811 instance pointer.
+ *
+ * @returns  0 on success, < 0 on DMA error.
+ */
+static ws2811_return_t hw_wait(ws2811_backend_t *backend, ws2811_t *ws2811)
+{
+    volatile dma_t *dma = ws2811->device->dma;
+
+    (void)backend;
+
+    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    {
+        return WS2811_SUCCESS;
+    }
+
+    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
+           !(dma->cs & RPI_DMA_CS_ERROR))
+    {
+        usleep(10);
+    }
+
+    if (dma->cs & RPI_DMA_CS_ERROR)
+    {
+        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
+        return WS2811_ERROR_DMA;
     }
 
     return WS2811_SUCCESS;
 }
 
+/**
+ * Stop the peripherals, unmap them and release the transmit buffers.  Only
+ * releases what was set up if called after a failed hw_init().
+ *
+ * @param    backend  Backend instance pointer.
+ * @param    ws2811   ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+static void hw_fini(ws2811_backend_t *backend, ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int i;
+
+    (void)backend;
+
+    if (device->hw_running)
+    {
+        switch (device->driver_mode) {
+        case PWM:
+            stop_pwm(ws2811);
+            break;
+        case PCM:
+            while (!(device->pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
+            stop_pcm(ws2811);
+            break;
+        }
+        device->hw_running = 0;
+    }
+
+    unmap_registers(ws2811);
+
+    dma_mem_free(&device->dma_mem);
+
+    if (device->mbox_handle != -1)
+    {
+        device->mbox_ops->close(device->mbox_handle);
+        device->mbox_handle = -1;
+    }
+
+    if (device->spi_fd > 0)
+    {
+        close(device->spi_fd);
+        device->spi_fd = 0;
+
+        for (i = 0; i < DMA_BUFFERS; i++)
+        {
+            free((uint8_t *)device->pxl_raw[i]);
+            device->pxl_raw[i] = NULL;
+        }
+    }
+}
+
+static ws2811_backend_t hw_backend = {
+    .detect = hw_detect,
+    .init = hw_init,
+    .start = hw_start,
+    .wait = hw_wait,
+    .fini = hw_fini,
+};
 
 /*
  *
@@ -876,83 +1821,61 @@ static ws2811_return_t spi_transfer(ws2811_t *ws2811)
  */
 ws2811_return_t ws2811_init(ws2811_t *ws2811)
 {
+    ws2811_backend_t *backend = ws2811->backend ? ws2811->backend : &hw_backend;
     ws2811_device_t *device;
-    const rpi_hw_t *rpi_hw;
-    int chan;
+    uint32_t byte_count = 0;
+    ws2811_return_t ret;
+    int chan, buf;
 
-    ws2811->rpi_hw = rpi_hw_detect();
+    ws2811->rpi_hw = backend->detect(backend);
     if (!ws2811->rpi_hw)
     {
         return WS2811_ERROR_HW_NOT_SUPPORTED;
     }
-    rpi_hw = ws2811->rpi_hw;
 
-    ws2811->device = malloc(sizeof(*ws2811->device));
+    ws2811->device = calloc(1, sizeof(*ws2811->device));
     if (!ws2811->device)
     {
         return WS2811_ERROR_OUT_OF_MEMORY;
     }
     device = ws2811->device;
+    device->backend = backend;
+    device->mbox_ops = ws2811->mbox_ops ? ws2811->mbox_ops : &mbox_ops_videocore;
+    device->mbox_handle = -1;
+
+    device->completion_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (device->completion_fd < 0)
+    {
+        ws2811_cleanup(ws2811);
+        return WS2811_ERROR_GENERIC;
+    }
 
     if (check_hwver_and_gpionum(ws2811) < 0)
     {
+        ws2811_cleanup(ws2811);
         return WS2811_ERROR_ILLEGAL_GPIO;
     }
 
     device->max_count = max_channel_led_count(ws2811);
 
-    if (device->driver_mode == SPI) {
-        return spi_init(ws2811);
-    }
-
-    // Determine how much physical memory we need for DMA
+    // Determine how much memory we need for the transmit buffers
     switch (device->driver_mode) {
     case PWM:
-        device->mbox.size = PWM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
+        byte_count = PWM_BYTE_COUNT(device->max_count, ws2811->freq);
         break;
 
     case PCM:
-        device->mbox.size = PCM_BYTE_COUNT(device->max_count, ws2811->freq) +
-                            sizeof(dma_cb_t);
+    case SPI:
+        byte_count = PCM_BYTE_COUNT(device->max_count, ws2811->freq);
         break;
     }
-    // Round up to page size multiple
-    device->mbox.size = (device->mbox.size + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1);
-
-    device->mbox.handle = mbox_open();
-    if (device->mbox.handle == -1)
-    {
-        return WS2811_ERROR_MAILBOX_DEVICE;
-    }
-
-    device->mbox.mem_ref = mem_alloc(device->mbox.handle, device->mbox.size, PAGE_SIZE,
-                                     rpi_hw->videocore_base == 0x40000000 ? 0xC : 0x4);
-    if (device->mbox.mem_ref == 0)
-    {
-        return WS2811_ERROR_OUT_OF_MEMORY;
-    }
-
-    device->mbox.bus_addr = mem_lock(device->mbox.handle, device->mbox.mem_ref);
-    if (device->mbox.bus_addr == (uint32_t) ~0UL)
-    {
-       mem_free(device->mbox.handle, device->mbox.size);
-       return WS2811_ERROR_MEM_LOCK;
-    }
 
-    device->mbox.virt_addr = mapmem(BUS_TO_PHYS(device->mbox.bus_addr), device->mbox.size, DEV_MEM);
-    if (!device->mbox.virt_addr)
+    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
+    for (buf = 0; buf < DMA_BUFFERS; buf++)
     {
-        mem_unlock(device->mbox.handle, device->mbox.mem_ref);
-        mem_free(device->mbox.handle, device->mbox.size);
-
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MMAP;
+        device->pxl_raw[buf] = NULL;
+        device->dma_cb[buf] = NULL;
     }
-
-    // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
-    device->pxl_raw = NULL;
-    device->dma_cb = NULL;
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         ws2811->channel[chan].leds = NULL;
@@ -994,8 +1917,13 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
 
     }
 
-    device->dma_cb = (dma_cb_t *)device->mbox.virt_addr;
-    device->pxl_raw = (uint8_t *)device->mbox.virt_addr + sizeof(dma_cb_t);
+    // Allocate the transmit buffers and set up the hardware
+    if ((ret = backend->init(backend, ws2811, device->driver_mode, byte_count,
+                             device->pxl_raw)) != WS2811_SUCCESS)
+    {
+        ws2811_cleanup(ws2811);
+        return ret;
+    }
 
     switch (device->driver_mode) {
     case PWM:
@@ -1003,49 +1931,20 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
        break;
 
     case PCM:
+    case SPI:
        pcm_raw_init(ws2811);
        break;
     }
 
-    memset((dma_cb_t *)device->dma_cb, 0, sizeof(dma_cb_t));
-
-    // Cache the DMA control block bus address
-    device->dma_cb_addr = addr_to_bus(device, device->dma_cb);
-
-    // Map the physical registers into userspace
-    if (map_registers(ws2811))
+    if (staging_init(ws2811))
     {
         ws2811_cleanup(ws2811);
-        return WS2811_ERROR_MAP_REGISTERS;
+        return WS2811_ERROR_OUT_OF_MEMORY;
     }
 
-    // Initialize the GPIO pins
-    if (gpio_init(ws2811))
+    if (ws2811->parallel_encode && encode_workers_start(ws2811))
     {
-        unmap_registers(ws2811);
-        ws2811_cleanup(ws2811);
-        return WS2811_ERROR_GPIO_INIT;
-    }
-
-    switch (device->driver_mode) {
-    case PWM:
-        // Setup the PWM, clocks, and DMA
-        if (setup_pwm(ws2811))
-        {
-            unmap_registers(ws2811);
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_PWM_SETUP;
-        }
-        break;
-    case PCM:
-    // Setup the PCM, clock, and DMA
-        if (setup_pcm(ws2811))
-        {
-            unmap_registers(ws2811);
-            ws2811_cleanup(ws2811);
-            return WS2811_ERROR_PCM_SETUP;
-        }
-        break;
+        fprintf(stderr, "Unable to start encode threads, encoding channels sequentially\n");
     }
 
     return WS2811_SUCCESS;
@@ -1060,26 +1959,17 @@ ws2811_return_t ws2811_init(ws2811_t *ws2811)
  */
 void ws2811_fini(ws2811_t *ws2811)
 {
-    volatile pcm_t *pcm = ws2811->device->pcm;
-
+    output_thread_stop(ws2811);
     ws2811_wait(ws2811);
-    switch (ws2811->device->driver_mode) {
-    case PWM:
-        stop_pwm(ws2811);
-        break;
-    case PCM:
-        while (!(pcm->cs & RPI_PCM_CS_TXE)) ;    // Wait till TX FIFO is empty
-        stop_pcm(ws2811);
-        break;
-    }
-
-    unmap_registers(ws2811);
 
+    // Stops the hardware and releases the transmit buffers
     ws2811_cleanup(ws2811);
 }
 
 /**
- * Wait for any executing DMA operation to complete before returning.
+ * Wait for any executing DMA operation to complete before returning.  Sleeps
+ * until the transfer is expected to be finished and only lets the backend
+ * poll the DMA status for whatever is left after that.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
@@ -1087,56 +1977,68 @@ void ws2811_fini(ws2811_t *ws2811)
  */
 ws2811_return_t ws2811_wait(ws2811_t *ws2811)
 {
-    volatile dma_t *dma = ws2811->device->dma;
+    ws2811_device_t *device = ws2811->device;
+    const struct timespec *t = &device->completion_time;
+    struct timespec now;
 
-    if (ws2811->device->driver_mode == SPI)  // Nothing to do for SPI
+    // Sleeping until a point in time that has just passed still costs the
+    // timer slack, so only sleep if the transfer can't be done yet
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec < t->tv_sec) || ((now.tv_sec == t->tv_sec) && (now.tv_nsec < t->tv_nsec)))
     {
-        return WS2811_SUCCESS;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL) == EINTR)
+            ;
     }
 
-    while ((dma->cs & RPI_DMA_CS_ACTIVE) &&
-           !(dma->cs & RPI_DMA_CS_ERROR))
-    {
-        usleep(10);
-    }
+    return device->backend->wait(device->backend, ws2811);
+}
 
-    if (dma->cs & RPI_DMA_CS_ERROR)
+/**
+ * Get a file descriptor that becomes readable once the frame started by the
+ * last ws2811_render() is expected to be completely clocked out.  It can be
+ * used with poll()/select() to block without spinning on the DMA status; read
+ * 8 bytes from it to acknowledge the notification.  The descriptor is owned by
+ * the driver and stays valid until ws2811_fini().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  File descriptor, -1 if the driver is not initialized.
+ */
+int ws2811_get_completion_fd(ws2811_t *ws2811)
+{
+    if (!ws2811->device)
     {
-        fprintf(stderr, "DMA Error: %08x\n", dma->debug);
-        return WS2811_ERROR_DMA;
+        return -1;
     }
 
-    return WS2811_SUCCESS;
+    return ws2811->device->completion_fd;
 }
 
 /**
- * Render the DMA buffer from the user supplied LED arrays and start the DMA
- * controller.  This will update all LEDs on both PWM channels.
+ * Encode the user supplied LED arrays and copy the result into the idle
+ * buffer.  Only LEDs that changed since the last frame are encoded.  Encoding
+ * runs in cached memory and the changed words are copied into the idle one of
+ * the two buffers, both while the previous frame is still transmitting.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
  * @returns  None
  */
-ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+static void render_prepare(ws2811_t *ws2811)
 {
-    volatile uint8_t *pxl_raw = ws2811->device->pxl_raw;
-    int driver_mode = ws2811->device->driver_mode;
-    int bitpos;
-    int i, k, l, chan;
-    unsigned j;
-    ws2811_return_t ret = WS2811_SUCCESS;
+    ws2811_device_t *device = ws2811->device;
     uint32_t protocol_time = 0;
-    static uint64_t previous_timestamp = 0;
+    int chan;
+
+    // Brightness or gamma changes require everything to be encoded again
+    update_symbol_tables(ws2811);
 
-    bitpos = (driver_mode == SPI ? 7 : 31);
+    // Channels are encoded in parallel to each other and to the running DMA
+    ws2811->encoded_count = encode_channels(ws2811);
 
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
-
-        int wordpos = chan; // PWM & PCM
-        int bytepos = 0;    // SPI
-        const int scale = (channel->brightness & 0xff) + 1;
         uint8_t array_size = 3; // Assume 3 color LEDs, RGB
 
         // If our shift mask includes the highest nibble, then we have 4 LEDs, RBGW.
@@ -1145,81 +2047,37 @@ ws2811_return_t  ws2811_render(ws2811_t *ws2811)
             array_size = 4;
         }
 
-        // 1.25µs per bit
-        const uint32_t channel_protocol_time = channel->count * array_size * 8 * 1.25;
+        // 1.25µs per bit at 800kHz
+        const uint32_t channel_protocol_time = (uint64_t)channel->count * array_size * 8 *
+                                               1000000 / ws2811->freq;
 
         // Only using the channel which takes the longest as both run in parallel
         if (channel_protocol_time > protocol_time)
         {
             protocol_time = channel_protocol_time;
         }
+    }
+    device->protocol_time = protocol_time;
 
-        for (i = 0; i < channel->count; i++)                // Led
-        {
-            uint8_t color[] =
-            {
-                channel->gamma[(((channel->leds[i] >> channel->rshift) & 0xff) * scale) >> 8], // red
-                channel->gamma[(((channel->leds[i] >> channel->gshift) & 0xff) * scale) >> 8], // green
-                channel->gamma[(((channel->leds[i] >> channel->bshift) & 0xff) * scale) >> 8], // blue
-                channel->gamma[(((channel->leds[i] >> channel->wshift) & 0xff) * scale) >> 8], // white
-            };
+    // The DMA engine may still be reading the other buffer
+    staging_flush(ws2811);
+}
 
-            for (j = 0; j < array_size; j++)               // Color
-            {
-                for (k = 7; k >= 0; k--)                   // Bit
-                {
-                    // Inversion is handled by hardware for PWM, otherwise by software here
-                    uint8_t symbol = SYMBOL_LOW;
-                    if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_LOW_INV;
-
-                    if (color[j] & (1 << k))
-                    {
-                        symbol = SYMBOL_HIGH;
-                        if ((driver_mode != PWM) && channel->invert) symbol = SYMBOL_HIGH_INV;
-                    }
-
-                    for (l = 2; l >= 0; l--)               // Symbol
-                    {
-                        uint32_t *wordptr = &((uint32_t *)pxl_raw)[wordpos];   // PWM & PCM
-                        volatile uint8_t  *byteptr = &pxl_raw[bytepos];    // SPI
-
-                        if (driver_mode == SPI)
-                        {
-                            *byteptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *byteptr |= (1 << bitpos);
-                            }
-                        }
-                        else  // PWM & PCM
-                        {
-                            *wordptr &= ~(1 << bitpos);
-                            if (symbol & (1 << l))
-                            {
-                                *wordptr |= (1 << bitpos);
-                            }
-                        }
-
-                        bitpos--;
-                        if (bitpos < 0)
-                        {
-                            if (driver_mode == SPI)
-                            {
-                                bytepos++;
-                                bitpos = 7;
-                            }
-                            else  // PWM & PCM
-                            {
-                                // Every other word is on the same channel for PWM
-                                wordpos += (driver_mode == PWM ? 2 : 1);
-                                bitpos = 31;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
+/**
+ * Wait for the previous frame and the LED reset time, then send out the frame
+ * in the idle buffer.  Afterwards the other buffer becomes the idle one.
+ *
+ * @param    ws2811   ws2811 instance pointer.
+ * @param    wait_us  Receives the time spent waiting, may be NULL.
+ *
+ * @returns  0 on success, < 0 on error.
+ */
+static ws2811_return_t render_output(ws2811_t *ws2811, uint64_t *wait_us)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret = WS2811_SUCCESS;
+    uint64_t duration_us = 0;
+    const uint64_t wait_start = get_microsecond_timestamp();
 
     // Wait for any previous DMA operation to complete.
     if ((ret = ws2811_wait(ws2811)) != WS2811_SUCCESS)
@@ -1229,29 +2087,179 @@ ws2811_return_t  ws2811_render(ws2811_t *ws2811)
 
     if (ws2811->render_wait_time != 0) {
         const uint64_t current_timestamp = get_microsecond_timestamp();
-        uint64_t time_diff = current_timestamp - previous_timestamp;
+        uint64_t time_diff = current_timestamp - device->previous_timestamp;
 
         if (ws2811->render_wait_time > time_diff) {
             usleep(ws2811->render_wait_time - time_diff);
         }
     }
 
-    if (driver_mode != SPI)
+    if (wait_us)
+    {
+        *wait_us = get_microsecond_timestamp() - wait_start;
+    }
+
+    ret = device->backend->start(device->backend, ws2811, device->buffer, &duration_us);
+    set_completion_time(ws2811, duration_us);
+
+    device->buffer = (device->buffer + 1) % DMA_BUFFERS;
+
+    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
+    device->previous_timestamp = get_microsecond_timestamp();
+    ws2811->render_wait_time = device->protocol_time + LED_RESET_WAIT_TIME;
+
+    return ret;
+}
+
+/**
+ * Output thread main loop, sends out every frame that ws2811_render_async
+ * leaves in the idle buffer.
+ *
+ * @param    arg  ws2811 instance pointer.
+ *
+ * @returns  NULL
+ */
+static void *output_thread_main(void *arg)
+{
+    ws2811_t *ws2811 = arg;
+    ws2811_device_t *device = ws2811->device;
+
+    pthread_mutex_lock(&device->output_lock);
+    for (;;)
     {
-        dma_start(ws2811);
+        ws2811_return_t ret;
+
+        while (!device->output_pending && !device->output_stop)
+        {
+            pthread_cond_wait(&device->output_cond, &device->output_lock);
+        }
+        if (!device->output_pending)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&device->output_lock);
+        ret = render_output(ws2811, NULL);
+        pthread_mutex_lock(&device->output_lock);
+
+        if ((ret != WS2811_SUCCESS) && (device->output_ret == WS2811_SUCCESS))
+        {
+            device->output_ret = ret;
+        }
+        device->output_pending = 0;
+        pthread_cond_broadcast(&device->output_cond);
     }
-    else
+    pthread_mutex_unlock(&device->output_lock);
+
+    return NULL;
+}
+
+/**
+ * Render the DMA buffer from the user supplied LED arrays and start the DMA
+ * controller.  This will update all LEDs on both PWM channels.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+ws2811_return_t  ws2811_render(ws2811_t *ws2811)
+{
+    ws2811_return_t ret;
+    uint64_t start, encoded, wait_us;
+
+    start = get_microsecond_timestamp();
+
+    // Don't touch the idle buffer before a frame from ws2811_render_async() is out
+    output_thread_sync(ws2811);
+
+    encoded = get_microsecond_timestamp();
+    render_prepare(ws2811);
+    ws2811->encode_time_us = get_microsecond_timestamp() - encoded;
+
+    ret = render_output(ws2811, &wait_us);
+    ws2811->wait_time_us = (encoded - start) + wait_us;
+
+    return ret;
+}
+
+/**
+ * Like ws2811_render(), but the wait for the previous frame, the LED reset
+ * time and the transfer itself (the whole SPI ioctl in SPI mode) happen on an
+ * output thread.  Returns as soon as the frame is encoded, so the caller can
+ * prepare the next frame while this one is sent.  Only blocks if the frame
+ * before is still waiting to be started, see ws2811_poll().
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  0 on success, otherwise the first error reported by an earlier
+ *           asynchronous transfer.
+ */
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_return_t ret;
+    uint64_t start, encoded;
+
+    if (!device->output_running)
     {
-        ret = spi_transfer(ws2811);
+        device->output_stop = 0;
+        device->output_pending = 0;
+        device->output_ret = WS2811_SUCCESS;
+        pthread_mutex_init(&device->output_lock, NULL);
+        pthread_cond_init(&device->output_cond, NULL);
+
+        if (pthread_create(&device->output_thread, NULL, output_thread_main, ws2811))
+        {
+            pthread_cond_destroy(&device->output_cond);
+            pthread_mutex_destroy(&device->output_lock);
+            return WS2811_ERROR_GENERIC;
+        }
+        device->output_running = 1;
     }
 
-    // LED_RESET_WAIT_TIME is added to allow enough time for the reset to occur.
-    previous_timestamp = get_microsecond_timestamp();
-    ws2811->render_wait_time = protocol_time + LED_RESET_WAIT_TIME;
+    start = get_microsecond_timestamp();
+    output_thread_sync(ws2811);
+
+    encoded = get_microsecond_timestamp();
+    render_prepare(ws2811);
+    ws2811->encode_time_us = get_microsecond_timestamp() - encoded;
+    ws2811->wait_time_us = encoded - start;
+
+    pthread_mutex_lock(&device->output_lock);
+    ret = device->output_ret;
+    device->output_ret = WS2811_SUCCESS;
+    device->output_pending = 1;
+    pthread_cond_broadcast(&device->output_cond);
+    pthread_mutex_unlock(&device->output_lock);
 
     return ret;
 }
 
+/**
+ * Check if the previous frame has been handed to the hardware, in which case
+ * ws2811_render_async() and ws2811_render() can encode the next one right away.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  1 if the next frame can be rendered without blocking, 0 otherwise.
+ */
+int ws2811_poll(ws2811_t *ws2811)
+{
+    ws2811_device_t *device = ws2811->device;
+    int ready;
+
+    if (!device->output_running)
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&device->output_lock);
+    ready = !device->output_pending;
+    pthread_mutex_unlock(&device->output_lock);
+
+    return ready;
+}
+
 const char * ws2811_get_return_t_str(const ws2811_return_t state)
 {
     const int index = -state;
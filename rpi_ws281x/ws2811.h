@@ -41,6 +41,14 @@ extern "C" {
 
 #define WS2811_TARGET_FREQ                       800000   // Can go as low as 400000
 
+// Transmit buffers, the next frame is written to one while the other one is sent
+#define WS2811_BUFFER_COUNT                      2
+
+// Driver modes, selected by the GPIO of channel 0
+#define WS2811_MODE_PWM                          1
+#define WS2811_MODE_PCM                          2
+#define WS2811_MODE_SPI                          3
+
 // 4 color R, G, B and W ordering
 #define SK6812_STRIP_RGBW                        0x18100800
 #define SK6812_STRIP_RBGW                        0x18100008
@@ -64,6 +72,8 @@ extern "C" {
 #define SK6812W_STRIP                            SK6812_STRIP_GRBW
 
 struct ws2811_device;
+struct ws2811_backend;
+struct mbox_ops;
 
 typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
 typedef struct
@@ -89,6 +99,12 @@ typedef struct
     uint32_t freq;                               //< Required output frequency
     int dmanum;                                  //< DMA number _not_ already in use
     ws2811_channel_t channel[RPI_PWM_CHANNELS];
+    int encoded_count;                           //< Number of LEDs re-encoded by the last render
+    int parallel_encode;                         //< Encode each channel on its own CPU core (multi-core Pis)
+    const struct mbox_ops *mbox_ops;             //< GPU memory allocator of the Pi backend, NULL for the VideoCore mailbox
+    struct ws2811_backend *backend;              //< Hardware access, NULL for the Raspberry Pi peripherals
+    uint32_t wait_time_us;                       //< Time the last render blocked on earlier frames
+    uint32_t encode_time_us;                     //< Time the last render spent encoding
 } ws2811_t;
 
 #define WS2811_RETURN_STATES(X)                                                             \
@@ -117,10 +133,31 @@ typedef enum {
     WS2811_RETURN_STATE_COUNT
 } ws2811_return_t;
 
+// Hardware access of the driver.  The default backend drives the Raspberry Pi
+// peripherals, mock.h provides one that runs on any Linux machine.
+typedef struct ws2811_backend
+{
+    // Describe the Pi the LEDs are connected to, NULL if unsupported
+    const rpi_hw_t *(*detect)(struct ws2811_backend *backend);
+    // Allocate byte_count bytes for each of pxl_raw and set up the hardware for the given WS2811_MODE_xxx
+    ws2811_return_t (*init)(struct ws2811_backend *backend, ws2811_t *ws2811, int mode,
+                            uint32_t byte_count, volatile uint8_t *pxl_raw[WS2811_BUFFER_COUNT]);
+    // Start sending pxl_raw[buffer], *duration_us receives the time until the transfer is done
+    ws2811_return_t (*start)(struct ws2811_backend *backend, ws2811_t *ws2811, int buffer,
+                             uint64_t *duration_us);
+    // Called once the transfer should be done, blocks until it is and reports errors
+    ws2811_return_t (*wait)(struct ws2811_backend *backend, ws2811_t *ws2811);
+    // Stop the hardware and release what init allocated, also after a failed init
+    void (*fini)(struct ws2811_backend *backend, ws2811_t *ws2811);
+} ws2811_backend_t;
+
 ws2811_return_t ws2811_init(ws2811_t *ws2811);                         //< Initialize buffers/hardware
 void ws2811_fini(ws2811_t *ws2811);                                    //< Tear it all down
 ws2811_return_t ws2811_render(ws2811_t *ws2811);                       //< Send LEDs off to hardware
+ws2811_return_t ws2811_render_async(ws2811_t *ws2811);                 //< Send LEDs off to hardware without waiting
+int ws2811_poll(ws2811_t *ws2811);                                     //< Check if the next render won't block
 ws2811_return_t ws2811_wait(ws2811_t *ws2811);                         //< Wait for DMA completion
+int ws2811_get_completion_fd(ws2811_t *ws2811);                        //< Get fd that turns readable on DMA completion
 const char * ws2811_get_return_t_str(const ws2811_return_t state);     //< Get string representation of the given return state
 
 #ifdef __cplusplus
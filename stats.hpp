@@ -0,0 +1,165 @@
+#ifndef __STATS_HPP
+#define __STATS_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+
+#include <fibre/fibre.hpp>
+
+// Histogram of durations in µs. The buckets are fixed: one per µs below 16 µs,
+// then 4 per power of two up to 2^24 µs (16 s). The error of a percentile is
+// therefore at most 25%.
+// One thread records, any number of threads may read. All counters are
+// atomics, so neither side ever waits for the other.
+class Histogram {
+public:
+    static constexpr unsigned LINEAR_BUCKETS = 16;
+    static constexpr unsigned BUCKET_COUNT = LINEAR_BUCKETS + (24 - 4) * 4;
+
+    void record(uint32_t value_us) {
+        buckets_[bucket(value_us)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        if (value_us > max_.load(std::memory_order_relaxed))
+            max_.store(value_us, std::memory_order_relaxed); // only one thread writes
+    }
+
+    // Only to be called by the recording thread
+    void clear() {
+        for (unsigned i = 0; i < BUCKET_COUNT; ++i)
+            buckets_[i].store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // Returns the upper end of the bucket that contains the given fraction
+    // (0...1) of all recorded values, 0 if there are none.
+    uint32_t percentile(float fraction) const {
+        uint32_t count = count_.load(std::memory_order_relaxed);
+        uint32_t rank = static_cast<uint32_t>(fraction * count);
+        uint32_t seen = 0;
+        if (!count)
+            return 0;
+        for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return std::min(upper_bound(i), max());
+        }
+        return max(); // the count was ahead of the buckets
+    }
+
+    uint32_t max() const { return max_.load(std::memory_order_relaxed); }
+
+private:
+    static unsigned bucket(uint32_t value) {
+        if (value < LINEAR_BUCKETS)
+            return value;
+        unsigned exponent = 31 - __builtin_clz(value); // >= 4
+        if (exponent >= 24)
+            return BUCKET_COUNT - 1;
+        return LINEAR_BUCKETS + (exponent - 4) * 4 + ((value >> (exponent - 2)) & 3);
+    }
+
+    static uint32_t upper_bound(unsigned bucket) {
+        if (bucket < LINEAR_BUCKETS)
+            return bucket;
+        unsigned exponent = (bucket - LINEAR_BUCKETS) / 4 + 4;
+        unsigned sub = (bucket - LINEAR_BUCKETS) % 4;
+        return ((4 + sub + 1) << (exponent - 2)) - 1;
+    }
+
+    std::atomic<uint32_t> buckets_[BUCKET_COUNT] = {};
+    std::atomic<uint32_t> count_{0};
+    std::atomic<uint32_t> max_{0};
+};
+
+// Duration statistics of one step of the render loop
+class StageStats {
+public:
+    void record(uint32_t value_us) {
+        histogram_.record(value_us);
+    }
+
+    void update() {
+        p50_us_ = histogram_.percentile(0.5f);
+        p99_us_ = histogram_.percentile(0.99f);
+        max_us_ = histogram_.max();
+    }
+
+    void clear() {
+        histogram_.clear();
+    }
+
+private:
+    Histogram histogram_;
+    // Updated by the render loop, read by Fibre. 32-bit values are never torn.
+    uint32_t p50_us_ = 0;
+    uint32_t p99_us_ = 0;
+    uint32_t max_us_ = 0;
+
+public:
+    FIBRE_EXPORTS(StageStats,
+        make_fibre_ro_property("p50_us", &p50_us_),
+        make_fibre_ro_property("p99_us", &p99_us_),
+        make_fibre_ro_property("max_us", &max_us_)
+    );
+};
+
+// Render loop statistics, exposed as the "stats" Fibre object.
+// The render loop records every frame and calls update() to refresh the
+// properties, which are read by the Fibre threads.
+class Stats {
+public:
+    StageStats animation; // LEDController::render
+    StageStats encode;    // encoding in ws2811_render_async
+    StageStats dma_wait;  // blocked on the previous frame in ws2811_render_async
+    StageStats sleep;     // waiting for the next frame deadline
+
+    // Refreshes the properties, with fps averaged since the last call
+    void update(uint64_t timestamp_ns, uint64_t frames, uint64_t dropped_frames, uint64_t overruns) {
+        if (reset_requested_.exchange(false)) {
+            animation.clear();
+            encode.clear();
+            dma_wait.clear();
+            sleep.clear();
+        }
+        animation.update();
+        encode.update();
+        dma_wait.update();
+        sleep.update();
+
+        if (timestamp_ns > last_update_ns_ && last_update_ns_)
+            fps_ = (frames - last_frames_) * 1e9f / (timestamp_ns - last_update_ns_);
+        last_update_ns_ = timestamp_ns;
+        last_frames_ = frames;
+        dropped_frames_ = static_cast<uint32_t>(dropped_frames);
+        overruns_ = static_cast<uint32_t>(overruns);
+    }
+
+    // Clears the histograms, the render loop does this on its next update
+    void reset() {
+        reset_requested_ = true;
+    }
+
+private:
+    std::atomic<bool> reset_requested_{false};
+    uint64_t last_update_ns_ = 0;
+    uint64_t last_frames_ = 0;
+    float fps_ = 0;
+    uint32_t dropped_frames_ = 0;
+    uint32_t overruns_ = 0;
+
+public:
+    FIBRE_EXPORTS(Stats,
+        make_fibre_ro_property("fps", &fps_),
+        make_fibre_ro_property("dropped_frames", &dropped_frames_),
+        make_fibre_ro_property("overruns", &overruns_),
+        make_fibre_function("reset", *obj, &Stats::reset),
+        make_fibre_object("animation", animation.make_fibre_definitions()),
+        make_fibre_object("encode", encode.make_fibre_definitions()),
+        make_fibre_object("dma_wait", dma_wait.make_fibre_definitions()),
+        make_fibre_object("sleep", sleep.make_fibre_definitions())
+    );
+};
+
+#endif // __STATS_HPP
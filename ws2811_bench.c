@@ -0,0 +1,241 @@
+/*
+ * ws2811_bench.c
+ *
+ * Measures how long ws2811_render() takes to encode a frame for different
+ * strip lengths, strip types and driver modes.  Runs against the mock
+ * backend, so no LEDs or Raspberry Pi are needed.  Every LED changes in every
+ * frame, so each frame is encoded completely.
+ *
+ * Usage: ws2811_bench [-f frames] [-p]
+ *     -f frames  Number of measured frames per configuration (default 200)
+ *     -p         Encode the PWM channels in parallel
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpi_ws281x/ws2811.h"
+#include "rpi_ws281x/mock.h"
+
+
+#define ARRAY_SIZE(stuff)       (sizeof(stuff) / sizeof(stuff[0]))
+
+#define WARMUP_FRAMES           10
+
+typedef struct
+{
+    const char *name;
+    int gpionum[RPI_PWM_CHANNELS];               // GPIO of each channel, 0 if unused
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+    { "PWM",   { 18, 0 } },
+    { "PWMx2", { 18, 13 } },
+    { "PCM",   { 21, 0 } },
+    { "SPI",   { 10, 0 } },
+};
+
+static const struct
+{
+    const char *name;
+    int strip_type;
+} strip_types[] = {
+    { "RGB",  WS2811_STRIP_GRB },
+    { "RGBW", SK6812_STRIP_GRBW },
+};
+
+static const int led_counts[] = { 100, 300, 1000, 3000, 10000 };
+
+static uint64_t timestamp_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Render frames in one configuration and print the timing statistics.
+ *
+ * @param    mode        Driver mode to use.
+ * @param    count       Number of LEDs per channel.
+ * @param    type        Index into strip_types.
+ * @param    invert      Invert the output.
+ * @param    frames      Number of frames to measure.
+ * @param    parallel    Encode the channels in parallel.
+ * @param    samples     Room for the render time of each frame.
+ *
+ * @returns  0 on success, -1 on error.
+ */
+static int bench(const bench_mode_t *mode, int count, int type, int invert, int frames,
+                 int parallel, uint64_t *samples)
+{
+    ws2811_mock_t mock;
+    ws2811_t ledstring;
+    ws2811_return_t ret;
+    int chan, channels = 0, frame, i;
+    uint64_t median, p99;
+
+    ws2811_mock_init(&mock);
+    mock.instant = 1;
+
+    memset(&ledstring, 0, sizeof(ledstring));
+    ledstring.freq = WS2811_TARGET_FREQ;
+    ledstring.dmanum = 10;
+    ledstring.parallel_encode = parallel;
+    ledstring.backend = &mock.backend;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        ws2811_channel_t *channel = &ledstring.channel[chan];
+
+        if (!mode->gpionum[chan])
+        {
+            continue;
+        }
+
+        channel->gpionum = mode->gpionum[chan];
+        channel->count = count;
+        channel->invert = invert;
+        channel->strip_type = strip_types[type].strip_type;
+        channel->brightness = 255;
+        channels++;
+    }
+
+    if ((ret = ws2811_init(&ledstring)) != WS2811_SUCCESS)
+    {
+        fprintf(stderr, "ws2811_init failed: %s\n", ws2811_get_return_t_str(ret));
+        return -1;
+    }
+
+    for (chan = 0; chan < channels; chan++)
+    {
+        for (i = 0; i < count; i++)
+        {
+            ledstring.channel[chan].leds[i] = (i * 0x01020304) ^ (chan << 8);
+        }
+    }
+
+    for (frame = -WARMUP_FRAMES; frame < frames; frame++)
+    {
+        uint64_t start;
+
+        // Change every LED so nothing can be skipped
+        for (chan = 0; chan < channels; chan++)
+        {
+            for (i = 0; i < count; i++)
+            {
+                ledstring.channel[chan].leds[i] ^= 0x01010101;
+            }
+        }
+
+        // Don't wait for the LED reset time, the mock has no LEDs to reset
+        ledstring.render_wait_time = 0;
+
+        start = timestamp_ns();
+        ret = ws2811_render(&ledstring);
+        if (frame >= 0)
+        {
+            samples[frame] = timestamp_ns() - start;
+        }
+
+        if (ret != WS2811_SUCCESS)
+        {
+            fprintf(stderr, "ws2811_render failed: %s\n", ws2811_get_return_t_str(ret));
+            ws2811_fini(&ledstring);
+            return -1;
+        }
+        if (ledstring.encoded_count != count * channels)
+        {
+            fprintf(stderr, "only %d of %d LEDs were encoded\n", ledstring.encoded_count,
+                    count * channels);
+            ws2811_fini(&ledstring);
+            return -1;
+        }
+    }
+
+    ws2811_fini(&ledstring);
+
+    qsort(samples, frames, sizeof(*samples), compare_u64);
+    median = samples[frames / 2];
+    p99 = samples[(frames * 99) / 100 < frames ? (frames * 99) / 100 : frames - 1];
+
+    printf("%-6s %-5s %3d %6d %12.1f %12.1f %8.2f\n", mode->name, strip_types[type].name,
+           invert, count, median / 1000.0, p99 / 1000.0, (double)median / (count * channels));
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = 200, parallel = 0;
+    uint64_t *samples;
+    unsigned m, t, c;
+    int opt, invert;
+
+    while ((opt = getopt(argc, argv, "f:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            frames = atoi(optarg);
+            break;
+        case 'p':
+            parallel = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f frames] [-p]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frames < 1)
+    {
+        fprintf(stderr, "frames must be at least 1\n");
+        return 1;
+    }
+
+    samples = malloc(frames * sizeof(*samples));
+    if (!samples)
+    {
+        return 1;
+    }
+
+    printf("%-6s %-5s %3s %6s %12s %12s %8s\n", "mode", "type", "inv", "leds",
+           "median[us]", "p99[us]", "ns/LED");
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++)
+    {
+        for (t = 0; t < ARRAY_SIZE(strip_types); t++)
+        {
+            for (invert = 0; invert < 2; invert++)
+            {
+                for (c = 0; c < ARRAY_SIZE(led_counts); c++)
+                {
+                    if (bench(&modes[m], led_counts[c], t, invert, frames, parallel, samples))
+                    {
+                        free(samples);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    free(samples);
+
+    return 0;
+}
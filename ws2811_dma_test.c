@@ -0,0 +1,426 @@
+/*
+ * ws2811_dma_test.c
+ *
+ * Checks the segmented DMA memory and the control block chains of the LED
+ * driver against a fake mailbox.  The fake keeps track of its allocations on
+ * the heap, maps anonymous memory where the real one maps GPU memory and hands
+ * out made up bus addresses, so no Raspberry Pi is needed.
+ *
+ * Usage: ws2811_dma_test
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "rpi_ws281x/mailbox.h"
+#include "rpi_ws281x/dma.h"
+
+
+#define ARRAY_SIZE(stuff)       (sizeof(stuff) / sizeof(stuff[0]))
+
+#define FAKE_HANDLE             42
+#define FAKE_MEM_FLAGS          0xC
+#define FAKE_MAX_ALLOCS         64
+#define FAKE_BUS_BASE           0xC0000000
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// Which call of the fake mailbox fails
+typedef enum
+{
+    FAIL_NONE,
+    FAIL_ALLOC,
+    FAIL_LOCK,
+    FAIL_MAP,
+} fail_op_t;
+
+typedef struct
+{
+    unsigned size;
+    uint32_t bus_addr;                        // 0 while unlocked
+    uint8_t *virt_addr;                       // NULL while unmapped
+} fake_alloc_t;
+
+static fake_alloc_t *fake_allocs[FAKE_MAX_ALLOCS];   // indexed by mem_ref - 1
+static int fake_live;                         // allocated and not yet freed
+static int fake_locked;                       // locked and not yet unlocked
+static uint32_t fake_next_bus;
+static int fake_calls[FAIL_MAP + 1];          // calls of each operation so far
+static fail_op_t fail_op;
+static int fail_call;                         // index of the call of fail_op that fails
+
+static int failures;
+
+static void fake_reset(fail_op_t op, int call)
+{
+    memset(fake_calls, 0, sizeof(fake_calls));
+    fake_next_bus = FAKE_BUS_BASE;
+    fail_op = op;
+    fail_call = call;
+}
+
+static int fake_fails(fail_op_t op)
+{
+    return fake_calls[op]++ == fail_call && fail_op == op;
+}
+
+static fake_alloc_t *fake_lookup(int file_desc, unsigned handle)
+{
+    CHECK(file_desc == FAKE_HANDLE);
+    if (handle == 0 || handle > FAKE_MAX_ALLOCS || !fake_allocs[handle - 1])
+    {
+        CHECK(!"unknown mem_ref");
+        return NULL;
+    }
+
+    return fake_allocs[handle - 1];
+}
+
+static int fake_open(void)
+{
+    return FAKE_HANDLE;
+}
+
+static void fake_close(int file_desc)
+{
+    CHECK(file_desc == FAKE_HANDLE);
+}
+
+static unsigned fake_mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags)
+{
+    fake_alloc_t *alloc;
+    int i;
+
+    CHECK(file_desc == FAKE_HANDLE);
+    CHECK(size > 0 && size <= DMA_SEGMENT_SIZE);
+    CHECK(size % PAGE_SIZE == 0);
+    CHECK(align == PAGE_SIZE);
+    CHECK(flags == FAKE_MEM_FLAGS);
+
+    if (fake_fails(FAIL_ALLOC))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < FAKE_MAX_ALLOCS; i++)
+    {
+        if (!fake_allocs[i])
+        {
+            break;
+        }
+    }
+    if (i == FAKE_MAX_ALLOCS || !(alloc = calloc(1, sizeof(*alloc))))
+    {
+        return 0;
+    }
+
+    alloc->size = size;
+    fake_allocs[i] = alloc;
+    fake_live++;
+
+    return i + 1;
+}
+
+static unsigned fake_mem_free(int file_desc, unsigned handle)
+{
+    fake_alloc_t *alloc = fake_lookup(file_desc, handle);
+
+    if (!alloc)
+    {
+        return ~0U;
+    }
+
+    CHECK(!alloc->bus_addr);
+    free(alloc);
+    fake_allocs[handle - 1] = NULL;
+    fake_live--;
+
+    return 0;
+}
+
+static unsigned fake_mem_lock(int file_desc, unsigned handle)
+{
+    fake_alloc_t *alloc = fake_lookup(file_desc, handle);
+
+    if (!alloc || fake_fails(FAIL_LOCK))
+    {
+        return ~0U;
+    }
+
+    CHECK(!alloc->bus_addr);
+    // Leave a page between the segments, so that only following the control
+    // blocks gets from one to the next
+    alloc->bus_addr = fake_next_bus;
+    fake_next_bus += alloc->size + PAGE_SIZE;
+    fake_locked++;
+
+    return alloc->bus_addr;
+}
+
+static unsigned fake_mem_unlock(int file_desc, unsigned handle)
+{
+    fake_alloc_t *alloc = fake_lookup(file_desc, handle);
+
+    if (!alloc)
+    {
+        return ~0U;
+    }
+
+    CHECK(alloc->bus_addr);
+    alloc->bus_addr = 0;
+    alloc->virt_addr = NULL;
+    fake_locked--;
+
+    return 0;
+}
+
+static void *fake_map_fixed(void *addr, unsigned base, unsigned size)
+{
+    void *mem;
+    int i;
+
+    if (fake_fails(FAIL_MAP))
+    {
+        return NULL;
+    }
+
+    CHECK(((uintptr_t)addr & (PAGE_SIZE - 1)) == 0);
+
+    for (i = 0; i < FAKE_MAX_ALLOCS; i++)
+    {
+        fake_alloc_t *alloc = fake_allocs[i];
+
+        if (alloc && alloc->bus_addr && BUS_TO_PHYS(alloc->bus_addr) == base)
+        {
+            CHECK(alloc->size == size);
+            CHECK(!alloc->virt_addr);
+
+            mem = mmap(addr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            if (mem == MAP_FAILED)
+            {
+                return NULL;
+            }
+
+            alloc->virt_addr = mem;
+            return mem;
+        }
+    }
+
+    CHECK(!"map_fixed of memory that isn't locked");
+
+    return NULL;
+}
+
+static const mbox_ops_t fake_ops = {
+    .open = fake_open,
+    .close = fake_close,
+    .mem_alloc = fake_mem_alloc,
+    .mem_free = fake_mem_free,
+    .mem_lock = fake_mem_lock,
+    .mem_unlock = fake_mem_unlock,
+    .map_fixed = fake_map_fixed,
+};
+
+/**
+ * Translate a bus address back to where the fake mapped it, independently of
+ * the driver's own bookkeeping.
+ *
+ * @param    bus_addr  Bus address.
+ *
+ * @returns  Virtual address, NULL if bus_addr isn't in a mapped allocation.
+ */
+static volatile uint8_t *fake_bus_to_virt(uint32_t bus_addr)
+{
+    int i;
+
+    for (i = 0; i < FAKE_MAX_ALLOCS; i++)
+    {
+        fake_alloc_t *alloc = fake_allocs[i];
+
+        if (alloc && alloc->virt_addr && bus_addr - alloc->bus_addr < alloc->size)
+        {
+            return alloc->virt_addr + (bus_addr - alloc->bus_addr);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Allocate the DMA memory for byte_count bytes per buffer, build the control
+ * block chains and follow them like the DMA engine would.
+ *
+ * @param    byte_count  Size of each DMA buffer in bytes.
+ *
+ * @returns  Number of mem_alloc calls.
+ */
+static int test_chain(uint32_t byte_count)
+{
+    uint32_t cb_count = (byte_count + DMA_SEGMENT_SIZE - 1) / DMA_SEGMENT_SIZE;
+    dma_mem_t mem;
+    ws2811_return_t ret;
+    int buf, allocs;
+    uint32_t i;
+
+    printf("chain of %u bytes\n", byte_count);
+
+    memset(&mem, 0, sizeof(mem));
+    fake_reset(FAIL_NONE, 0);
+
+    ret = dma_mem_alloc(&mem, &fake_ops, FAKE_HANDLE, FAKE_MEM_FLAGS, byte_count);
+    CHECK(ret == WS2811_SUCCESS);
+    if (ret != WS2811_SUCCESS)
+    {
+        dma_mem_free(&mem);
+        return 0;
+    }
+    allocs = fake_calls[FAIL_ALLOC];
+
+    CHECK(mem.cb_count == (int)cb_count);
+    CHECK(fake_live == mem.segment_count);
+    CHECK(fake_locked == mem.segment_count);
+
+    dma_chain_init(&mem, byte_count, RPI_DMA_TI_SRC_INC, 0x7e20c018);
+
+    for (buf = 0; buf < WS2811_BUFFER_COUNT; buf++)
+    {
+        uint32_t addr = dma_mem_bus_addr(&mem, mem.cb[buf]);
+        uint32_t total = 0;
+
+        // Every byte of the buffer must be backed by memory
+        memset((uint8_t *)mem.buf[buf], 0xa5, byte_count);
+
+        for (i = 0; i < cb_count; i++)
+        {
+            volatile dma_cb_t *cb = (volatile dma_cb_t *)fake_bus_to_virt(addr);
+            uint32_t len = i + 1 < cb_count ? DMA_SEGMENT_SIZE : byte_count - i * DMA_SEGMENT_SIZE;
+
+            CHECK((addr & 0x1f) == 0);
+            CHECK(cb == &mem.cb[buf][i]);
+            if (!cb)
+            {
+                break;
+            }
+
+            CHECK(cb->ti == RPI_DMA_TI_SRC_INC);
+            CHECK(cb->dest_ad == 0x7e20c018);
+            CHECK(cb->txfr_len == len);
+            CHECK(cb->txfr_len <= DMA_SEGMENT_SIZE);
+            CHECK(fake_bus_to_virt(cb->source_ad) == mem.buf[buf] + i * DMA_SEGMENT_SIZE);
+            // The DMA engine reads the segment in one go, so it must not span two allocations
+            CHECK(fake_bus_to_virt(cb->source_ad + len - 1) == mem.buf[buf] + i * DMA_SEGMENT_SIZE + len - 1);
+            total += cb->txfr_len;
+
+            if (i + 1 < cb_count)
+            {
+                CHECK(cb->nextconbk != 0);
+            }
+            else
+            {
+                CHECK(cb->nextconbk == 0);
+            }
+            addr = cb->nextconbk;
+        }
+
+        CHECK(total == byte_count);
+    }
+
+    dma_mem_free(&mem);
+    CHECK(fake_live == 0);
+    CHECK(fake_locked == 0);
+
+    return allocs;
+}
+
+/**
+ * Let each mailbox call of the allocation fail in turn and check that
+ * dma_mem_free() releases everything that was allocated up to then.
+ *
+ * @param    byte_count  Size of each DMA buffer in bytes.
+ * @param    allocs      Number of mem_alloc calls without failures.
+ *
+ * @returns  None
+ */
+static void test_partial_alloc(uint32_t byte_count, int allocs)
+{
+    static const struct
+    {
+        fail_op_t op;
+        ws2811_return_t ret;
+    } cases[] = {
+        { FAIL_ALLOC, WS2811_ERROR_OUT_OF_MEMORY },
+        { FAIL_LOCK, WS2811_ERROR_MEM_LOCK },
+        { FAIL_MAP, WS2811_ERROR_MMAP },
+    };
+    dma_mem_t mem;
+    unsigned c;
+    int call;
+
+    printf("partial allocation of %u bytes, %d segments\n", byte_count, allocs);
+
+    for (c = 0; c < ARRAY_SIZE(cases); c++)
+    {
+        for (call = 0; call < allocs; call++)
+        {
+            memset(&mem, 0, sizeof(mem));
+            fake_reset(cases[c].op, call);
+
+            CHECK(dma_mem_alloc(&mem, &fake_ops, FAKE_HANDLE, FAKE_MEM_FLAGS, byte_count) ==
+                  cases[c].ret);
+
+            dma_mem_free(&mem);
+            CHECK(fake_live == 0);
+            CHECK(fake_locked == 0);
+            CHECK(mem.segments == NULL);
+            CHECK(mem.virt_addr == NULL);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t byte_counts[] = {
+        4,
+        DMA_SEGMENT_SIZE - 4,
+        DMA_SEGMENT_SIZE,
+        DMA_SEGMENT_SIZE + 4,
+        3 * DMA_SEGMENT_SIZE - 4,
+        3 * DMA_SEGMENT_SIZE,
+        3 * DMA_SEGMENT_SIZE + 4,
+    };
+    unsigned i;
+    int allocs;
+
+    (void)argc;
+    (void)argv;
+
+    for (i = 0; i < ARRAY_SIZE(byte_counts); i++)
+    {
+        allocs = test_chain(byte_counts[i]);
+        test_partial_alloc(byte_counts[i], allocs);
+    }
+
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+
+    return 0;
+}